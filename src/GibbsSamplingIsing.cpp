@@ -1,260 +1,3975 @@
 // Gibbs sampling on a synthetic Ising model.
 // See http://arxiv.org/pdf/1602.07415v2.pdf for details.
-// As in the paper,  assume prior weights B_x is 0.
+// As in the paper,  assume prior weights B_x is 0, except in weighted
+// mode, which supports per-edge couplings and per-vertex fields.
 #include <iostream>
 #include <omp.h>
-#include <map>
 #include <vector>
 #include <limits>
 #include <math.h>
+#include <stdlib.h>
+#include <fstream>
+#include <string>
+#include <climits>
+#include <stdint.h>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iterator>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LATTICE_SIMD
+#endif
 
 using namespace std;
 
-#define HOGWILD 1
-#define N_THREADS 1
+enum Mode { HOGWILD, CYCLADES, CHECKERBOARD, SWENDSEN_WANG, WOLFF };
+
+#define MAX_POTTS_STATES 36
+enum GraphType { LATTICE_2D, RANDOM_GRAPH, GRAPH_FILE };
+enum PottsInteraction { POTTS_INTERACTION, CLOCK_INTERACTION };
+enum SimdLevel { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+enum StateLayout { SHARED_LAYOUT, PADDED_LAYOUT };
+enum Reorder { NO_REORDER, BFS_REORDER, RCM_REORDER, MORTON_REORDER };
+
+// Run parameters. Defaults match the original compile-time settings and
+// may be overridden on the command line or from a config file.
+struct Config {
+    int n;                          // Number of vertices
+    int delta;                      // Maximum degree of vertices
+    double beta;                    // Inverse temperature
+    int n_threads;
+    int n_iterations;
+    Mode mode;
+    GraphType graph;
+    string graph_file;              // Binary graph for GRAPH_FILE
+    Reorder reorder;                // Vertex relabeling, see ReorderSampler
+
+    // If set, convert this text edge list to graph_file and exit.
+    string convert_edge_list;
+
+    // Store one bit per spin instead of one int.
+    bool packed_state;
+
+    // Parallel tempering: run one replica at each of these betas instead
+    // of a single chain at beta, and try swapping neighboring temperatures
+    // every swap_interval sweeps. See RunTempering.
+    vector<double> betas;
+    int swap_interval;
+
+    // Run 64 independent Ising chains at once, see UpdateMultiSpin.
+    bool multispin;
+
+    // Hogwild state layout, see BuildPaddedLayout.
+    StateLayout layout;
+
+    // Pin threads to cores and place each thread's part of the state and
+    // graph on its own NUMA node, see PlaceSampler.
+    bool numa;
+
+    // Potts mode: variables take potts_q labels instead of +-1, coupled
+    // by potts_interaction. 0 selects the Ising model.
+    int potts_q;
+    PottsInteraction potts_interaction;
+
+    // Weighted model: couplings J_ij ~ N(1, coupling_sigma^2) and fields
+    // h_i ~ N(field_mean, field_sigma^2), drawn from the seed.
+    bool weighted;
+    double coupling_sigma;
+    double field_mean;
+    double field_sigma;
+
+    // Widest instruction set the lattice kernels may use. The kernel is
+    // picked at startup from what the CPU supports.
+    SimdLevel simd;
+
+    // Cyclades batch size, 0 selects N/(2*DELTA). The paper shows that
+    // sampling fewer than (1-eps)*N/DELTA vertices per batch keeps the
+    // connected components of the conflict graph small w.h.p.
+    int cyclades_batch_size;
+
+    // Draw a new Cyclades schedule every sweep, planned batch by batch on
+    // an extra thread while the workers sample, see PipelinedSweep.
+    bool cyclades_pipeline;
+
+    // Clusters flipped per --mode=wolff sweep, 0 to calibrate, see
+    // CalibrateWolff.
+    int wolff_clusters;
+
+    // Write a snapshot of the state every snapshot_interval sweeps,
+    // 0 disables snapshots. An empty snapshot_file means stdout.
+    int snapshot_interval;
+    string snapshot_file;
+    // Write snapshots as a compressed binary sample file, see SnapshotWriter.
+    bool snapshot_binary;
+    // Read the sample file back at the end and check every snapshot.
+    bool verify_snapshots;
+
+    // If set, print the snapshot at read_iteration (the last one at or
+    // before it, -1 for the last in the file) from this sample file and exit.
+    string read_snapshots;
+    int read_iteration;
+
+    // Benchmark mode: time the sampler at each of these thread counts
+    // instead of running it once. Results go to benchmark_output, or
+    // stdout if empty, as CSV or JSON lines.
+    vector<int> benchmark_threads;
+    bool benchmark_json;
+    string benchmark_output;
+
+    // Convergence diagnostics. Magnetization and energy per spin are
+    // recorded every sweep after burn_in. A report is printed every
+    // diagnostics_interval sweeps, and the run stops early once both
+    // series reach target_ess effective samples and their standard
+    // errors are below tolerance (each check skipped when 0).
+    int diagnostics_interval;
+    int burn_in;
+    double target_ess;
+    double tolerance;
+
+    // Master seed for graph generation, the initial state and the
+    // per-update random numbers.
+    uint64_t seed;
+
+    // Write a checkpoint to checkpoint_file every checkpoint_interval
+    // sweeps (0 for only at the end). With resume set, continue from
+    // checkpoint_file if it exists.
+    string checkpoint_file;
+    int checkpoint_interval;
+    bool resume;
+
+    Config() : n(100*100), delta(4), beta(1.29), n_threads(1),
+	       n_iterations(10000), mode(HOGWILD), graph(LATTICE_2D), reorder(NO_REORDER),
+	       packed_state(false), swap_interval(10), multispin(false), layout(SHARED_LAYOUT), numa(false),
+	       potts_q(0), potts_interaction(POTTS_INTERACTION),
+	       weighted(false), coupling_sigma(0), field_mean(0), field_sigma(0),
+	       simd(SIMD_AVX512), cyclades_batch_size(0), cyclades_pipeline(false), wolff_clusters(0),
+	       snapshot_interval(0), snapshot_binary(false), verify_snapshots(false), read_iteration(-1),
+	       benchmark_json(false), diagnostics_interval(0), burn_in(0),
+	       target_ess(0), tolerance(0), seed(0), checkpoint_interval(0), resume(false) {}
+};
+
+Config config;
+
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel Random
+// Numbers: As Easy as 1, 2, 3", SC 2011). Every output is a pure function
+// of (key, counter), so threads need no shared generator state and a run
+// is reproducible regardless of which thread performs which update.
+inline void Philox4x32(uint32_t key[2], uint32_t counter[4]) {
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; round++) {
+	uint64_t product_0 = (uint64_t)0xD2511F53 * counter[0];
+	uint64_t product_1 = (uint64_t)0xCD9E8D57 * counter[2];
+	uint32_t c0 = (uint32_t)(product_1 >> 32) ^ counter[1] ^ k0;
+	uint32_t c1 = (uint32_t)product_1;
+	uint32_t c2 = (uint32_t)(product_0 >> 32) ^ counter[3] ^ k1;
+	uint32_t c3 = (uint32_t)product_0;
+	counter[0] = c0; counter[1] = c1; counter[2] = c2; counter[3] = c3;
+	k0 += 0x9E3779B9;
+	k1 += 0xBB67AE85;
+    }
+}
+
+// 32 random bits for the given vertex, sweep and stream, keyed by seed.
+// Spin updates compare these against ConditionalTable thresholds, which
+// the vectorized kernels can reproduce exactly.
+inline uint32_t RandomBits(uint64_t seed, uint32_t vertex, uint32_t sweep, uint32_t stream) {
+    uint32_t key[2] = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+    uint32_t counter[4] = {vertex, sweep, stream, 0};
+    Philox4x32(key, counter);
+    return counter[0];
+}
+
+// Uniform double in [0, 1) for the given vertex, sweep and stream, keyed
+// by seed. The stream distinguishes independent uses within one sweep.
+inline double RandomUniform(uint64_t seed, uint32_t vertex, uint32_t sweep, uint32_t stream) {
+    uint32_t key[2] = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+    uint32_t counter[4] = {vertex, sweep, stream, 0};
+    Philox4x32(key, counter);
+    uint64_t bits = ((uint64_t)counter[0] << 21) ^ counter[1];
+    return (double)(bits & ((1ULL << 53) - 1)) * (1.0 / (1ULL << 53));
+}
+
+// Contiguous array that either owns its elements or views memory owned
+// elsewhere, such as a memory-mapped graph file. Views are read-only in
+// practice: mapped files are mapped without write access.
+template <typename T>
+class Array {
+public:
+    Array() : data_(NULL), size_(0) {}
+    Array(const Array &other) { *this = other; }
+
+    Array &operator=(const Array &other) {
+	if (this == &other) return *this;
+	storage_ = other.storage_;
+	size_ = other.size_;
+	data_ = other.data_ == other.storage_.data() ? storage_.data() : other.data_;
+	return *this;
+    }
+
+    void assign(size_t size, const T &value) {
+	storage_.assign(size, value);
+	data_ = storage_.data();
+	size_ = size;
+    }
+
+    void resize(size_t size) {
+	storage_.resize(size);
+	data_ = storage_.data();
+	size_ = size;
+    }
+
+    void View(const T *data, size_t size) {
+	vector<T>().swap(storage_);
+	data_ = const_cast<T *>(data);
+	size_ = size;
+    }
+
+    T &operator[](size_t i) { return data_[i]; }
+    const T &operator[](size_t i) const { return data_[i]; }
+    size_t size() const { return size_; }
+    T *begin() const { return data_; }
+    T *end() const { return data_ + size_; }
+    bool Owned() const { return data_ == storage_.data(); }
 
-#define N (100*100)                 // Number of vertices
-#define DELTA 4                     // Maximum degree of vertices
-#define BETA 1.29                      // Inverse temperature
-#define N_ITERATIONS 10000
+private:
+    vector<T> storage_;
+    T *data_;
+    size_t size_;
+};
 
-#define MAX_EDGES (N*N)
-#define MAX_EDGE_INSERTION_TRIES (N*N)
+// Compressed sparse row adjacency. The neighbors of vertex v are
+// neighbors[offsets[v]] ... neighbors[offsets[v+1]-1].
+struct Graph {
+    Array<int> offsets;
+    Array<int> neighbors;
+};
 
-typedef map<int, vector<int> > Graph;
+inline int Degree(const Graph &g, int v) {
+    return g.offsets[v+1] - g.offsets[v];
+}
+
+// Ising model with couplings J_ij and fields h_i, with energy
+// -sum_{(i,j)} J_ij x_i x_j - sum_i h_i x_i. Same CSR layout as Graph,
+// but each coupling sits next to its neighbor index so the update reads
+// one contiguous array.
+struct WeightedEdge {
+    int neighbor;
+    float coupling;
+};
+
+struct WeightedGraph {
+    Array<int> offsets;
+    Array<WeightedEdge> edges;
+    Array<float> field;
+};
 
 // Note that access pattern has form:
 // [thread][batch][state index].
 typedef vector<vector<vector<int> > > AccessPattern;
 
-void Print2DState(vector<int> &state) {
-    if (DELTA != 4) {
+// Character for one variable of a printed state. For conciseness, Ising
+// -1 prints as 0. Potts labels print as 0-9 then a-z.
+char SpinChar(int value) {
+    if (config.potts_q > 0) {
+	if (value >= 0 && value < config.potts_q) {
+	    return "0123456789abcdefghijklmnopqrstuvwxyz"[value];
+	}
+    }
+    else if (value == 1) {
+	return '1';
+    }
+    else if (value == -1) {
+	return '0';
+    }
+    cout << "Something went wrong..." << endl;
+    exit(0);
+}
+
+void Print2DState(const vector<int> &state, ostream &out = cout) {
+    if (config.delta != 4) {
 	cout << "Error: For 2D Ising model delta must be 4." << endl;
 	exit(0);
     }
-    if ((int)sqrt(N) * (int)sqrt(N) != N) {
+    if ((int)sqrt(config.n) * (int)sqrt(config.n) != config.n) {
 	cout << "Error: For 2D Ising model N must be a square." << endl;
 	exit(0);
     }
 
     string state_string = "";
-    int length = sqrt(N);
+    int length = sqrt(config.n);
     for (int i = 0; i < length; i++) {
 	for (int j = 0; j < length; j++) {
-	    if (state[i*length+j] == 1) {
-		state_string += "1";
-	    }
-	    else if (state[i*length+j] == -1) {
-		state_string += "0";
-	    }
-	    else {
-		cout << "Something went wrong..." << endl;
-		exit(0);
-	    }
+	    state_string += SpinChar(state[i*length+j]);
 	}
 	state_string += "\n";
     }
-    system("clear");
-    cout << state_string << endl;
+    out << state_string << endl;
 }
 
-void PrintState(vector<int> &state) {
-    // For conciseness, print -1 as 0.
+void PrintState(const vector<int> &state, ostream &out = cout) {
     string state_string = "";
     for (int i = 0; i < state.size(); i++) {
-	if (state[i] == 1) {
-	    state_string += "1";
+	state_string += SpinChar(state[i]);
+    }
+    out << state_string << endl;
+}
+
+// Binary sample file, little endian:
+//   SampleFileHeader
+//   chunks, each a SampleChunkHeader and compressed_bytes of zlib data
+//   SampleIndexEntry[n_entries], then SampleFileTrailer
+// Spins are coded as (s+1)/2 for Ising and s for Potts. A key chunk holds
+// every code, bits_per_spin bits each, packed into uint64 words. A delta
+// chunk holds the spins that changed since the previous chunk as varint
+// gaps between positions, each followed by the new code as a varint when
+// bits_per_spin > 1. Every key_interval-th chunk is a key chunk, and so is
+// any chunk whose delta would be larger, so a reader seeks to the last key
+// at or before a sweep and replays at most key_interval-1 deltas. The
+// trailer locates the index; a file cut short by a crash has no trailer
+// but can still be scanned chunk by chunk.
+#define SAMPLE_FILE_MAGIC "CYCSAMPL"
+#define SAMPLE_INDEX_MAGIC "CYCINDEX"
+#define SAMPLE_FILE_VERSION 1
+enum SampleChunkType { KEY_CHUNK, DELTA_CHUNK };
+
+struct SampleFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t potts_q;           // 0 for Ising
+    uint64_t n;
+    uint32_t width;             // Lattice side length, 0 if not a lattice
+    uint32_t bits_per_spin;
+};
+
+struct SampleChunkHeader {
+    int64_t iteration;
+    uint32_t type;
+    uint32_t raw_bytes;
+    uint64_t compressed_bytes;
+};
+
+struct SampleIndexEntry {
+    int64_t iteration;
+    uint64_t offset;
+    uint32_t type;
+    uint32_t reserved;
+};
+
+struct SampleFileTrailer {
+    uint64_t index_offset;
+    uint64_t n_entries;
+    char magic[8];
+};
+
+inline uint32_t SpinCode(int value, uint32_t potts_q) {
+    return potts_q > 0 ? value : (value + 1) / 2;
+}
+
+inline int SpinValue(uint32_t code, uint32_t potts_q) {
+    return potts_q > 0 ? code : 2 * (int)code - 1;
+}
+
+uint64_t Fnv1a(const char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+	hash = (hash ^ (uint8_t)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void PutVarint(vector<uint8_t> &out, uint64_t value) {
+    while (value >= 0x80) {
+	out.push_back((uint8_t)(value | 0x80));
+	value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+bool GetVarint(const vector<uint8_t> &in, size_t &position, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && position < in.size(); shift += 7) {
+	uint8_t byte = in[position++];
+	value |= (uint64_t)(byte & 0x7f) << shift;
+	if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+void OpenSampleFile(const string &path, ifstream &in, SampleFileHeader &header, vector<SampleIndexEntry> &index);
+bool VerifySampleFile(const string &path, const vector<uint64_t> &hashes, size_t first);
+
+// Writes snapshots of the state on a background thread, so formatting,
+// compression and I/O never stall the sampling threads. Submit copies the
+// state and returns immediately. If the writer falls behind by more than
+// max_pending snapshots, new frames of the stdout animation are dropped
+// and counted instead; snapshots bound for a file are kept, so Submit
+// waits for room.
+class SnapshotWriter {
+public:
+    // An empty path writes text to stdout, clearing the screen before each
+    // snapshot so the lattice animates in place. A run resumed at sweep
+    // resume_iteration > 0 continues an existing file: the snapshots from
+    // that sweep on, which the resumed run takes again, are cut off and
+    // new ones are appended.
+    SnapshotWriter(const string &path, bool is_2d, bool binary, int resume_iteration = 0)
+	: path_(path), is_2d_(is_2d), to_stdout_(path.empty()), binary_(binary), done_(false), busy_(false),
+	  n_dropped_(0), n_resumed_(0) {
+	bool resume = !to_stdout_ && resume_iteration > 0 && access(path.c_str(), F_OK) == 0;
+	if (resume) {
+	    uint64_t end = binary ? ResumeBinary(resume_iteration) : ResumeText(resume_iteration);
+	    if (truncate(path.c_str(), end) == 0) {
+		file_.open(path.c_str(), binary ? ios::in | ios::out | ios::binary : ios::in | ios::out);
+		file_.seekp(end);
+	    }
+	}
+	else if (!to_stdout_) {
+	    file_.open(path.c_str(), binary ? ios::out | ios::binary : ios::out);
+	}
+	if (!to_stdout_ && !file_) {
+	    cout << "Error: Could not open snapshot file " << path << endl;
+	    exit(1);
+	}
+	if (binary_ && !resume) {
+	    SampleFileHeader header;
+	    memset(&header, 0, sizeof(header));
+	    memcpy(header.magic, SAMPLE_FILE_MAGIC, 8);
+	    header.version = SAMPLE_FILE_VERSION;
+	    header.potts_q = config.potts_q;
+	    header.n = config.n;
+	    header.width = is_2d ? (int)sqrt(config.n) : 0;
+	    header.bits_per_spin = 1;
+	    while (config.potts_q > (1 << header.bits_per_spin)) header.bits_per_spin++;
+	    bits_per_spin_ = header.bits_per_spin;
+	    file_.write((const char *)&header, sizeof(header));
+	}
+	thread_ = std::thread(&SnapshotWriter::Run, this);
+    }
+
+    ~SnapshotWriter() {
+	{
+	    lock_guard<mutex> lock(mutex_);
+	    done_ = true;
+	}
+	ready_.notify_one();
+	thread_.join();
+	if (binary_) {
+	    SampleFileTrailer trailer;
+	    trailer.index_offset = file_.tellp();
+	    trailer.n_entries = index_.size();
+	    memcpy(trailer.magic, SAMPLE_INDEX_MAGIC, 8);
+	    file_.write((const char *)index_.data(), index_.size() * sizeof(SampleIndexEntry));
+	    file_.write((const char *)&trailer, sizeof(trailer));
+	}
+	if (file_.is_open()) {
+	    file_.close();
+	    if (file_.fail()) cerr << "Warning: Could not finish writing the snapshot file." << endl;
+	}
+	if (binary_ && config.verify_snapshots && !VerifySampleFile(path_, hashes_, n_resumed_)) {
+	    cout << "Error: " << path_ << " does not read back as written." << endl;
+	    exit(1);
+	}
+	if (n_dropped_ > 0) {
+	    cerr << "Warning: Dropped " << n_dropped_ << " snapshots because the writer fell behind." << endl;
+	}
+    }
+
+    // With wait set, blocks until there is room instead of dropping.
+    void Submit(int iteration, const vector<int> &state, bool wait = false) {
+	vector<int> copy(state);
+	wait = wait || !to_stdout_;
+	{
+	    unique_lock<mutex> lock(mutex_);
+	    while (wait && pending_.size() >= max_pending) space_.wait(lock);
+	    if (pending_.size() >= max_pending) {
+		n_dropped_++;
+		return;
+	    }
+	    pending_.push_back(make_pair(iteration, std::move(copy)));
+	}
+	ready_.notify_one();
+    }
+
+    // Block until every submitted snapshot has been handed to the OS, so a
+    // checkpoint taken now never gets ahead of the snapshot file.
+    void Flush() {
+	unique_lock<mutex> lock(mutex_);
+	while (!pending_.empty() || busy_) space_.wait(lock);
+	if (file_.is_open()) file_.flush();
+    }
+
+private:
+    static const size_t max_pending = 4;
+    static const int key_interval = 32;
+
+    void Run() {
+	while (true) {
+	    pair<int, vector<int> > snapshot;
+	    {
+		unique_lock<mutex> lock(mutex_);
+		while (pending_.empty() && !done_) ready_.wait(lock);
+		if (pending_.empty()) return;
+		snapshot = std::move(pending_.front());
+		pending_.pop_front();
+		busy_ = true;
+	    }
+	    space_.notify_all();
+	    if (binary_) {
+		WriteChunk(snapshot.first, snapshot.second);
+	    }
+	    else {
+		ostream &out = to_stdout_ ? cout : file_;
+		if (to_stdout_) out << "\033[H\033[2J";
+		else out << "# iteration " << snapshot.first << "\n";
+		if (is_2d_) Print2DState(snapshot.second, out);
+		else PrintState(snapshot.second, out);
+	    }
+	    {
+		lock_guard<mutex> lock(mutex_);
+		busy_ = false;
+	    }
+	    space_.notify_all();
+	}
+    }
+
+    // Offset of the first "# iteration" line at or after iteration, or the
+    // end of the file.
+    uint64_t ResumeText(int iteration) {
+	ifstream in(path_.c_str());
+	string line;
+	uint64_t start = 0;
+	while (getline(in, line)) {
+	    int sweep;
+	    if (sscanf(line.c_str(), "# iteration %d", &sweep) == 1 && sweep >= iteration) return start;
+	    start += line.size() + 1;
+	}
+	return start;
+    }
+
+    // Keep the chunks before iteration and return the offset after them.
+    // The trailing index is rewritten at the end of the run. The next chunk
+    // is a key chunk, since the writer has no previous state to diff.
+    uint64_t ResumeBinary(int iteration) {
+	ifstream in;
+	SampleFileHeader header;
+	vector<SampleIndexEntry> index;
+	OpenSampleFile(path_, in, header, index);
+	if (header.n != config.n || header.potts_q != config.potts_q) {
+	    cout << "Error: " << path_ << " holds snapshots of a different model." << endl;
+	    exit(1);
+	}
+	bits_per_spin_ = header.bits_per_spin;
+	uint64_t end = sizeof(header);
+	for (int i = 0; i < index.size() && index[i].iteration < iteration; i++) {
+	    SampleChunkHeader chunk;
+	    in.seekg(index[i].offset);
+	    in.read((char *)&chunk, sizeof(chunk));
+	    end = index[i].offset + sizeof(chunk) + chunk.compressed_bytes;
+	    index_.push_back(index[i]);
+	}
+	n_resumed_ = index_.size();
+	return end;
+    }
+
+    void WriteChunk(int iteration, const vector<int> &state) {
+	raw_.clear();
+	uint32_t type = KEY_CHUNK;
+	if (index_.size() % key_interval != 0 && !previous_.empty()) {
+	    type = DELTA_CHUNK;
+	    // Give up on the delta once it outgrows a key chunk.
+	    size_t key_bytes = ((size_t)state.size() * bits_per_spin_ + 63) / 64 * 8;
+	    long last = -1;
+	    for (int i = 0; i < state.size() && raw_.size() <= key_bytes; i++) {
+		if (state[i] == previous_[i]) continue;
+		PutVarint(raw_, i - last - 1);
+		if (bits_per_spin_ > 1) PutVarint(raw_, SpinCode(state[i], config.potts_q));
+		last = i;
+	    }
+	    if (raw_.size() > key_bytes) {
+		type = KEY_CHUNK;
+		raw_.clear();
+	    }
+	}
+	if (type == KEY_CHUNK) {
+	    vector<uint64_t> words(((size_t)state.size() * bits_per_spin_ + 63) / 64, 0);
+	    for (size_t i = 0; i < state.size(); i++) {
+		size_t bit = i * bits_per_spin_;
+		// A code straddles two words when bits_per_spin doesn't divide 64.
+		words[bit / 64] |= (uint64_t)SpinCode(state[i], config.potts_q) << (bit % 64);
+		if (bit % 64 + bits_per_spin_ > 64) {
+		    words[bit / 64 + 1] |= (uint64_t)SpinCode(state[i], config.potts_q) >> (64 - bit % 64);
+		}
+	    }
+	    raw_.assign((const uint8_t *)words.data(), (const uint8_t *)(words.data() + words.size()));
+	}
+	previous_ = state;
+
+	uLongf compressed_bytes = compressBound(raw_.size());
+	compressed_.resize(compressed_bytes);
+	if (compress2(compressed_.data(), &compressed_bytes, raw_.data(), raw_.size(), Z_BEST_SPEED) != Z_OK) {
+	    cout << "Error: Could not compress a snapshot." << endl;
+	    exit(1);
+	}
+	if (config.verify_snapshots) hashes_.push_back(Fnv1a((const char *)state.data(), state.size() * sizeof(int)));
+	SampleIndexEntry entry = {iteration, (uint64_t)file_.tellp(), type, 0};
+	SampleChunkHeader header = {iteration, type, (uint32_t)raw_.size(), compressed_bytes};
+	file_.write((const char *)&header, sizeof(header));
+	file_.write((const char *)compressed_.data(), compressed_bytes);
+	index_.push_back(entry);
+    }
+
+    string path_;
+    bool is_2d_;
+    bool to_stdout_;
+    bool binary_;
+    bool done_;
+    bool busy_;                         // Writing a snapshot taken off pending_
+    long n_dropped_;
+    ofstream file_;
+    deque<pair<int, vector<int> > > pending_;
+    mutex mutex_;
+    condition_variable ready_;
+    condition_variable space_;
+    std::thread thread_;
+
+    // Binary format state, only touched by the writer thread.
+    int bits_per_spin_;
+    vector<int> previous_;
+    vector<uint8_t> raw_;
+    vector<uint8_t> compressed_;
+    vector<SampleIndexEntry> index_;
+    vector<uint64_t> hashes_;           // Of each written state, with verify_snapshots
+    size_t n_resumed_;                  // Chunks kept from before a resume
+};
+
+// Read one chunk at offset and apply it to state.
+void ReadSampleChunk(ifstream &in, uint64_t offset, const SampleFileHeader &header, vector<int> &state) {
+    SampleChunkHeader chunk;
+    in.seekg(offset);
+    in.read((char *)&chunk, sizeof(chunk));
+    vector<uint8_t> compressed(chunk.compressed_bytes);
+    in.read((char *)compressed.data(), compressed.size());
+    vector<uint8_t> raw(chunk.raw_bytes);
+    uLongf raw_bytes = raw.size();
+    if (!in || uncompress(raw.data(), &raw_bytes, compressed.data(), compressed.size()) != Z_OK ||
+	raw_bytes != raw.size()) {
+	cout << "Error: Corrupt snapshot at offset " << offset << endl;
+	exit(1);
+    }
+    int bits = header.bits_per_spin;
+    uint64_t mask = (1ULL << bits) - 1;
+    if (chunk.type == KEY_CHUNK) {
+	if (raw.size() < (state.size() * bits + 63) / 64 * 8) {
+	    cout << "Error: Short key snapshot at offset " << offset << endl;
+	    exit(1);
 	}
-	else if (state[i] == -1) {
-	    state_string += "0";
+	const uint64_t *words = (const uint64_t *)raw.data();
+	for (size_t i = 0; i < state.size(); i++) {
+	    size_t bit = i * bits;
+	    uint64_t code = words[bit / 64] >> (bit % 64);
+	    if (bit % 64 + bits > 64) code |= words[bit / 64 + 1] << (64 - bit % 64);
+	    state[i] = SpinValue(code & mask, header.potts_q);
+	}
+	return;
+    }
+    size_t position = 0;
+    long last = -1;
+    uint64_t gap, code;
+    while (position < raw.size()) {
+	if (!GetVarint(raw, position, gap) || last + 1 + gap >= state.size()) {
+	    cout << "Error: Corrupt delta snapshot at offset " << offset << endl;
+	    exit(1);
+	}
+	last += 1 + gap;
+	if (bits > 1) {
+	    if (!GetVarint(raw, position, code)) {
+		cout << "Error: Corrupt delta snapshot at offset " << offset << endl;
+		exit(1);
+	    }
+	    state[last] = SpinValue(code, header.potts_q);
 	}
 	else {
-	    cout << "Something went wrong..." << endl;
-	    exit(0);
+	    // One bit per spin: Ising, or a Potts model with q = 2.
+	    state[last] = SpinValue(SpinCode(state[last], header.potts_q) ^ 1, header.potts_q);
+	}
+    }
+}
+
+// Open a sample file and read its header and chunk index. Uses the index
+// when the file has one and otherwise scans the chunk headers.
+void OpenSampleFile(const string &path, ifstream &in, SampleFileHeader &header, vector<SampleIndexEntry> &index) {
+    in.open(path.c_str(), ios::in | ios::binary);
+    if (!in.read((char *)&header, sizeof(header)) || memcmp(header.magic, SAMPLE_FILE_MAGIC, 8) != 0 ||
+	header.version != SAMPLE_FILE_VERSION || header.n == 0 || header.n >= INT_MAX ||
+	header.bits_per_spin == 0 || header.bits_per_spin > 32) {
+	cout << "Error: " << path << " is not a version " << SAMPLE_FILE_VERSION << " sample file." << endl;
+	exit(1);
+    }
+
+    SampleFileTrailer trailer;
+    in.seekg(0, ios::end);
+    uint64_t size = in.tellg();
+    if (size >= sizeof(header) + sizeof(trailer)) {
+	in.seekg(size - sizeof(trailer));
+	in.read((char *)&trailer, sizeof(trailer));
+    }
+    if (in && size >= sizeof(header) + sizeof(trailer) && memcmp(trailer.magic, SAMPLE_INDEX_MAGIC, 8) == 0 &&
+	trailer.index_offset + trailer.n_entries * sizeof(SampleIndexEntry) + sizeof(trailer) == size) {
+	index.resize(trailer.n_entries);
+	in.seekg(trailer.index_offset);
+	in.read((char *)index.data(), index.size() * sizeof(SampleIndexEntry));
+    }
+    else {
+	in.clear();
+	uint64_t offset = sizeof(header);
+	SampleChunkHeader chunk;
+	while (offset + sizeof(chunk) <= size) {
+	    in.seekg(offset);
+	    if (!in.read((char *)&chunk, sizeof(chunk)) || offset + sizeof(chunk) + chunk.compressed_bytes > size) break;
+	    SampleIndexEntry entry = {chunk.iteration, offset, chunk.type, 0};
+	    index.push_back(entry);
+	    offset += sizeof(chunk) + chunk.compressed_bytes;
 	}
+	in.clear();
+    }
+}
+
+// Replay every chunk of the sample file at path and check that the state
+// after chunk first+i hashes to hashes[i]. The first chunks are the ones a
+// resumed run kept, which it did not write itself.
+bool VerifySampleFile(const string &path, const vector<uint64_t> &hashes, size_t first) {
+    ifstream in;
+    SampleFileHeader header;
+    vector<SampleIndexEntry> index;
+    OpenSampleFile(path, in, header, index);
+    if (index.size() != first + hashes.size()) return false;
+    vector<int> state(header.n);
+    for (int i = 0; i < index.size(); i++) {
+	ReadSampleChunk(in, index[i].offset, header, state);
+	if (i >= first && Fnv1a((const char *)state.data(), state.size() * sizeof(int)) != hashes[i - first]) return false;
+    }
+    printf("Verified %d snapshots in %s\n", (int)hashes.size(), path.c_str());
+    return true;
+}
+
+// Print the snapshot at the largest iteration not above the requested one
+// (the last snapshot if iteration < 0).
+void ReadSnapshots(const string &path, int iteration) {
+    ifstream in;
+    SampleFileHeader header;
+    vector<SampleIndexEntry> index;
+    OpenSampleFile(path, in, header, index);
+
+    int target = -1;
+    for (int i = 0; i < index.size(); i++) {
+	if (iteration < 0 || index[i].iteration <= iteration) target = i;
+    }
+    if (target < 0) {
+	cout << "Error: No snapshot at or before iteration " << iteration << " in " << path << endl;
+	exit(1);
+    }
+    int key = target;
+    while (key > 0 && index[key].type != KEY_CHUNK) key--;
+    vector<int> state(header.n);
+    for (int i = key; i <= target; i++) ReadSampleChunk(in, index[i].offset, header, state);
+
+    // The printers and SpinChar read the model from config.
+    config.n = header.n;
+    config.potts_q = header.potts_q;
+    cout << "# iteration " << index[target].iteration << "\n";
+    if (header.width > 0 && (uint64_t)header.width * header.width == header.n) {
+	config.delta = 4;
+	Print2DState(state);
+    }
+    else {
+	PrintState(state);
     }
-    cout << state_string << endl;
 }
 
 void PrintGraph(Graph &g) {
-    for (int i = 0; i < N; i++) {
+    for (int i = 0; i < config.n; i++) {
 	cout << i << ": ";
-	for (int j = 0; j < g[i].size(); j++) {
-	    if (j != 0) cout << ", ";
-	    cout << g[i][j];
+	for (int j = g.offsets[i]; j < g.offsets[i+1]; j++) {
+	    if (j != g.offsets[i]) cout << ", ";
+	    cout << g.neighbors[j];
 	}
 	cout << endl;
     }
 }
 
 void PrintGraphStatistics(Graph &g) {
-    double min_degree = DELTA+1;
+    double min_degree = numeric_limits<double>::max();
     double max_degree = 0;
     double avg_degree = 0;
-    for (int i = 0; i < N; i++) {
-	min_degree = min(min_degree, (double)g[i].size());
-	max_degree = max(max_degree, (double)g[i].size());
-	avg_degree += g[i].size();
+    for (int i = 0; i < config.n; i++) {
+	min_degree = min(min_degree, (double)Degree(g, i));
+	max_degree = max(max_degree, (double)Degree(g, i));
+	avg_degree += Degree(g, i);
     }
-    avg_degree /= N;
+    avg_degree /= config.n;
     printf("Graph statistics:\n");
     printf("Min Degree: %lf\n", min_degree);
     printf("Max Degree: %lf\n", max_degree);
     printf("Avg Degree: %lf\n", avg_degree);
 }
 
+// Build a CSR graph from an undirected edge list. Each vertex lists its
+// neighbors in the order the edges were given. If weights holds one value
+// per edge, couplings receives them in the same order as g.neighbors.
+Graph BuildGraphFromEdges(int n_vertices, vector<pair<int, int> > &edges,
+			  const vector<float> &weights = vector<float>(), vector<float> *couplings = NULL) {
+    Graph g;
+    g.offsets.assign(n_vertices+1, 0);
+    for (int i = 0; i < edges.size(); i++) {
+	g.offsets[edges[i].first+1]++;
+	g.offsets[edges[i].second+1]++;
+    }
+    for (int i = 0; i < n_vertices; i++) {
+	g.offsets[i+1] += g.offsets[i];
+    }
+    g.neighbors.resize(g.offsets[n_vertices]);
+    if (couplings) couplings->resize(g.offsets[n_vertices]);
+    vector<int> fill_position(g.offsets.begin(), g.offsets.end()-1);
+    for (int i = 0; i < edges.size(); i++) {
+	int first = fill_position[edges[i].first]++;
+	int second = fill_position[edges[i].second]++;
+	g.neighbors[first] = edges[i].second;
+	g.neighbors[second] = edges[i].first;
+	if (couplings) (*couplings)[first] = (*couplings)[second] = weights[i];
+    }
+    return g;
+}
+
 Graph Generate2DIsingModelGraph() {
-    if (DELTA != 4) {
+    if (config.delta != 4) {
 	cout << "Error: For 2D Ising model delta must be 4." << endl;
 	exit(0);
     }
-    if ((int)sqrt(N) * (int)sqrt(N) != N) {
+    if ((int)sqrt(config.n) * (int)sqrt(config.n) != config.n) {
 	cout << "Error: For 2D Ising model N must be a square." << endl;
 	exit(0);
     }
 
-    Graph g;
-
-    // Initialize vertices.
-    for (int i = 0; i < N; i++) {
-	g[i] = vector<int>();
-    }
+    vector<pair<int, int> > edges;
 
     // Connect the adjacent neighbors of the graph as in a 2D lattice.
-    int length = (int)sqrt(N);
+    int length = (int)sqrt(config.n);
     for (int i = 0; i < length; i++) {
 	for (int j = 0; j < length; j++) {
 	    int cur_index = i*length+j;
 	    if (i + 1 < length) {
 		int bottom_neighbor = (i+1)*length+j;
-		g[cur_index].push_back(bottom_neighbor);
-		g[bottom_neighbor].push_back(cur_index);
+		edges.push_back(make_pair(cur_index, bottom_neighbor));
 	    }
 	    if (j + 1 < length) {
 		int right_neighbor = i*length+j+1;
-		g[cur_index].push_back(right_neighbor);
-		g[right_neighbor].push_back(cur_index);
+		edges.push_back(make_pair(cur_index, right_neighbor));
 	    }
 	}
     }
-    return g;
+    return BuildGraphFromEdges(config.n, edges);
 }
 
-// Initialize an empty graph g with a
-// synthetic ising graph.
-Graph GenerateRandomIsingModelGraph() {
-    Graph g;
+// Random integer in [0, bound) from 32 random bits, by multiply-shift.
+inline uint32_t RandomBelow(uint32_t bits, uint32_t bound) {
+    return (uint32_t)(((uint64_t)bits * bound) >> 32);
+}
+
+// Uniform random permutation of stubs in O(stubs.size()) work: every stub
+// is sent to a random bucket, then each bucket is shuffled by
+// Fisher-Yates. Bucket and chunk counts depend only on the input size, so
+// the result is the same for every thread count.
+void ShuffleStubs(vector<int> &stubs) {
+    const int bucket_size = 1024, n_chunks = 64;
+    int n = stubs.size();
+    int n_buckets = max(1, n / bucket_size);
+    int chunk_size = (n + n_chunks - 1) / n_chunks;
+    vector<int> bucket_of(n);
+    // counts[c*n_buckets+b] becomes where chunk c starts writing bucket b.
+    vector<int> counts((size_t)n_chunks * n_buckets, 0);
+#pragma omp parallel for
+    for (int c = 0; c < n_chunks; c++) {
+	for (int i = c * chunk_size; i < min(n, (c+1) * chunk_size); i++) {
+	    bucket_of[i] = RandomBelow(RandomBits(config.seed, i, 0, 4), n_buckets);
+	    counts[(size_t)c * n_buckets + bucket_of[i]]++;
+	}
+    }
+    vector<int> bucket_start(n_buckets+1, 0);
+    int position = 0;
+    for (int b = 0; b < n_buckets; b++) {
+	bucket_start[b] = position;
+	for (int c = 0; c < n_chunks; c++) {
+	    int count = counts[(size_t)c * n_buckets + b];
+	    counts[(size_t)c * n_buckets + b] = position;
+	    position += count;
+	}
+    }
+    bucket_start[n_buckets] = n;
+    vector<int> shuffled(n);
+#pragma omp parallel for
+    for (int c = 0; c < n_chunks; c++) {
+	for (int i = c * chunk_size; i < min(n, (c+1) * chunk_size); i++) {
+	    shuffled[counts[(size_t)c * n_buckets + bucket_of[i]]++] = stubs[i];
+	}
+    }
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int b = 0; b < n_buckets; b++) {
+	for (int i = bucket_start[b+1] - 1; i > bucket_start[b]; i--) {
+	    int j = bucket_start[b] + RandomBelow(RandomBits(config.seed, i, 1, 5), i - bucket_start[b] + 1);
+	    swap(shuffled[i], shuffled[j]);
+	}
+    }
+    stubs.swap(shuffled);
+}
 
-    // Initialize vertices.
-    for (int i = 0; i < N; i++) {
-	g[i] = vector<int>();
+// Random graph with every degree at most delta, from the configuration
+// model. Vertex v owns stubs v*delta ... v*delta+delta-1; after a shuffle,
+// the stubs at positions 2e and 2e+1 form edge e. Self loops and repeated
+// edges are then repaired by switching with a random good edge, which
+// keeps every degree. In the rare case no switch is found the edge is
+// dropped. All work is linear in n*delta and deterministic per seed.
+Graph GenerateRandomIsingModelGraph() {
+    int n = config.n, delta = config.delta;
+    if ((long long)n * delta >= INT_MAX) {
+	cout << "Error: N*DELTA is too large for a random graph." << endl;
+	exit(1);
     }
+    int n_stubs = n * delta, n_edges = n_stubs / 2;
+    vector<int> stub_at(n_stubs);
+    for (int i = 0; i < n_stubs; i++) stub_at[i] = i;
+    ShuffleStubs(stub_at);
+    // position_of[stub] is the inverse permutation. With an odd stub count
+    // the last position has no partner and stays unused.
+    vector<int> position_of(n_stubs);
+#pragma omp parallel for
+    for (int p = 0; p < n_stubs; p++) position_of[stub_at[p]] = p;
 
-    // Create random edges but make sure
-    // the Delta limit is not exceeded.
-    for (int i = 0; i < MAX_EDGES; i++) {
-	int random_vertex_1 = rand() % N;
-	int random_vertex_2 = rand() % N;
-	int n_tries = 0;
+    // Neighbor of v through its k-th stub, or -1 if that stub is unused.
+    vector<char> dropped(n_edges, 0);
+    auto neighbor = [&](int v, int k) {
+	int p = position_of[v * delta + k];
+	if (p >= 2 * n_edges || dropped[p/2]) return -1;
+	return stub_at[p^1] / delta;
+    };
 
-	while (random_vertex_1 == random_vertex_2 ||
-	       g[random_vertex_1].size() >= DELTA ||
-	       g[random_vertex_2].size() >= DELTA) {
-	    random_vertex_1 = rand() % N;
-	    random_vertex_2 = rand() % N;
+    // An edge is bad if it is a self loop or repeats an edge with a lower
+    // id; both endpoints agree on which copy of a repeated edge that is.
+    vector<char> bad(n_edges, 0);
+#pragma omp parallel
+    {
+	vector<int> w(delta), e(delta);
+#pragma omp for
+	for (int v = 0; v < n; v++) {
+	    for (int k = 0; k < delta; k++) {
+		w[k] = neighbor(v, k);
+		e[k] = position_of[v * delta + k] / 2;
+	    }
+	    for (int k = 0; k < delta; k++) {
+		if (w[k] < 0) continue;
+		bool repeated = w[k] == v;
+		for (int j = 0; j < delta && !repeated; j++) {
+		    repeated = w[j] == w[k] && e[j] < e[k];
+		}
+		if (repeated) bad[e[k]] = 1;
+	    }
+	}
+    }
 
-	    // Break if could not find valid edge to insert.
-	    if (n_tries++ >= MAX_EDGE_INSERTION_TRIES)
-		return g;
+    auto adjacent = [&](int v, int w) {
+	for (int k = 0; k < delta; k++) {
+	    if (neighbor(v, k) == w) return true;
+	}
+	return false;
+    };
+    auto place = [&](int p, int stub) {
+	stub_at[p] = stub;
+	position_of[stub] = p;
+    };
+    const int max_switch_tries = 100;
+    int n_dropped = 0;
+    for (int e = 0; e < n_edges; e++) {
+	if (!bad[e]) continue;
+	bool repaired = false;
+	for (int t = 0; t < max_switch_tries && !repaired; t++) {
+	    uint32_t bits = RandomBits(config.seed, e, t, 6);
+	    int f = RandomBelow(bits, n_edges);
+	    if (bad[f] || dropped[f]) continue;
+	    // Switch a-b, c-d to a-c, b-d, taking c-d in a random orientation.
+	    int q = 2*f + (bits & 1);
+	    int a = stub_at[2*e] / delta, b = stub_at[2*e+1] / delta;
+	    int c = stub_at[q] / delta, d = stub_at[q^1] / delta;
+	    if (a == c || b == d || adjacent(a, c) || adjacent(b, d)) continue;
+	    int stub_b = stub_at[2*e+1], stub_c = stub_at[q];
+	    place(2*e+1, stub_c);
+	    place(q, stub_b);
+	    bad[e] = 0;
+	    repaired = true;
 	}
+	if (!repaired) {
+	    dropped[e] = 1;
+	    bad[e] = 0;
+	    n_dropped++;
+	}
+    }
+    if (n_dropped > 0) {
+	cerr << "Warning: Dropped " << n_dropped << " edges that could not be made simple." << endl;
+    }
 
-	g[random_vertex_1].push_back(random_vertex_2);
-	g[random_vertex_2].push_back(random_vertex_1);
+    // Each vertex lists its neighbors in stub order.
+    Graph g;
+    g.offsets.assign(n+1, 0);
+#pragma omp parallel for
+    for (int v = 0; v < n; v++) {
+	for (int k = 0; k < delta; k++) g.offsets[v+1] += neighbor(v, k) >= 0;
+    }
+    for (int v = 0; v < n; v++) g.offsets[v+1] += g.offsets[v];
+    g.neighbors.resize(g.offsets[n]);
+#pragma omp parallel for
+    for (int v = 0; v < n; v++) {
+	int position = g.offsets[v];
+	for (int k = 0; k < delta; k++) {
+	    int w = neighbor(v, k);
+	    if (w >= 0) g.neighbors[position++] = w;
+	}
     }
     return g;
 }
 
-vector<int> GenerateIsingState() {
-    vector<int> state(N);
-    int n_ones = 0, n_negs = 0;
-    for (int i = 0; i < N; i++) {
-	if (rand() % 2 == 0) {
-	    state[i] = 1;
-	    n_ones++;
+// Binary graph file, little endian, meant to be mapped and used in place:
+//   GraphFileHeader
+//   int32 offsets[n_vertices+1]               at offsets_start
+//   int32 neighbors[n_entries]                at neighbors_start
+//   WeightedEdge edges[n_entries]             at edges_start, if weighted
+//   float field[n_vertices]                   at field_start, if weighted
+// Sections start on 64 byte boundaries. n_entries counts each undirected
+// edge twice and must fit in an int, like Graph's offsets.
+#define GRAPH_FILE_MAGIC "CYCGRAPH"
+#define GRAPH_FILE_VERSION 1
+#define GRAPH_FILE_WEIGHTED 1
+
+struct GraphFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t n_vertices;
+    uint64_t n_entries;
+    uint64_t offsets_start;
+    uint64_t neighbors_start;
+    uint64_t edges_start;
+    uint64_t field_start;
+};
+
+static_assert(sizeof(GraphFileHeader) == 64, "graph file header layout");
+static_assert(sizeof(WeightedEdge) == 8, "graph file edge layout");
+
+// Read-only mapping of a whole file, unmapped on destruction. Arrays that
+// view the mapping must not outlive it.
+class MappedFile {
+public:
+    MappedFile() : data_(NULL), size_(0) {}
+    ~MappedFile() {
+	if (data_) munmap(data_, size_);
+    }
+
+    void Open(const string &path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+	    cout << "Error: Could not open graph file " << path << endl;
+	    exit(1);
 	}
-	else {
-	    state[i] = -1;
-	    n_negs++;
+	size_ = st.st_size;
+	data_ = size_ > 0 ? mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data_ == MAP_FAILED) {
+	    data_ = NULL;
+	    cout << "Error: Could not map graph file " << path << endl;
+	    exit(1);
 	}
     }
-    return state;
+
+    const char *data() const { return (const char *)data_; }
+    size_t size() const { return size_; }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    void *data_;
+    size_t size_;
+};
+
+// Map a graph file and point g (and w, if the file is weighted) at its
+// sections without copying. The offsets and neighbor ids are checked in
+// one parallel pass, and a file that fails is rejected.
+void LoadGraphFile(const string &path, MappedFile &file, Graph &g, WeightedGraph &w) {
+    file.Open(path);
+    GraphFileHeader header;
+    if (file.size() < sizeof(header)) {
+	cout << "Error: " << path << " is too small to be a graph file." << endl;
+	exit(1);
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, GRAPH_FILE_MAGIC, 8) != 0 || header.version != GRAPH_FILE_VERSION) {
+	cout << "Error: " << path << " is not a version " << GRAPH_FILE_VERSION << " graph file." << endl;
+	exit(1);
+    }
+    uint64_t n = header.n_vertices, entries = header.n_entries;
+    bool weighted = header.flags & GRAPH_FILE_WEIGHTED;
+    // Written so that no start or count from the header can overflow, and
+    // aligned so the mapped arrays can be read in place.
+    auto section_fits = [&](uint64_t start, uint64_t count, size_t size, size_t align) {
+	return start <= file.size() && (file.size() - start) / size >= count && start % align == 0;
+    };
+    bool fits = n > 0 && n < INT_MAX && entries <= INT_MAX &&
+	section_fits(header.offsets_start, n+1, sizeof(int), alignof(int)) &&
+	section_fits(header.neighbors_start, entries, sizeof(int), alignof(int));
+    if (weighted) {
+	fits = fits && section_fits(header.edges_start, entries, sizeof(WeightedEdge), alignof(WeightedEdge)) &&
+	    section_fits(header.field_start, n, sizeof(float), alignof(float));
+    }
+    if (!fits) {
+	cout << "Error: " << path << " is truncated or has invalid or misaligned sections." << endl;
+	exit(1);
+    }
+
+    g.offsets.View((const int *)(file.data() + header.offsets_start), n+1);
+    g.neighbors.View((const int *)(file.data() + header.neighbors_start), entries);
+    if (weighted) {
+	w.offsets = g.offsets;
+	w.edges.View((const WeightedEdge *)(file.data() + header.edges_start), entries);
+	w.field.View((const float *)(file.data() + header.field_start), n);
+    }
+
+    // The kernels index the state with these without checks, so a corrupt
+    // file must not get past here. One O(N + E) pass, like the degree
+    // statistics printed at startup.
+    bool valid = g.offsets[0] == 0 && g.offsets[n] == entries;
+#pragma omp parallel for reduction(&&:valid)
+    for (int64_t i = 0; i < (int64_t)n; i++) {
+	valid = valid && g.offsets[i] <= g.offsets[i+1];
+    }
+#pragma omp parallel for reduction(&&:valid)
+    for (int64_t j = 0; j < (int64_t)entries; j++) {
+	valid = valid && (uint32_t)g.neighbors[j] < n && (!weighted || w.edges[j].neighbor == g.neighbors[j]);
+    }
+    if (!valid) {
+	cout << "Error: " << path << " has inconsistent offsets or out of range neighbors." << endl;
+	exit(1);
+    }
 }
 
-int PartitionDatapointsForHogwild(Graph &g, vector<int> &state, AccessPattern &pattern) {
-    pattern.resize(N_THREADS);
-    int n_datapoints_per_thread = N / N_THREADS;
-    for (int thread = 0; thread < N_THREADS; thread++) {
-	pattern[thread].resize(1);
-	int start = n_datapoints_per_thread * thread;
-	int end = n_datapoints_per_thread * (thread+1);
-	if (thread == N_THREADS-1) end = N;
-	for (int index = start; index < end; index++) {
-	    pattern[thread][0].push_back(index);
+// Convert a text edge list to a graph file. Lines are "u v" or "u v J"
+// for an undirected edge with coupling J (1 if omitted), or "h v value"
+// for the field of vertex v. Lines starting with # or % are comments.
+// Vertices are numbered from 0 and the vertex count is the largest id
+// plus one. The file is weighted if any coupling or field is given.
+void ConvertEdgeList(const string &input, const string &output) {
+    FILE *in = fopen(input.c_str(), "r");
+    if (!in) {
+	cout << "Error: Could not open edge list " << input << endl;
+	exit(1);
+    }
+    vector<pair<int, int> > edges;
+    vector<float> weights;
+    vector<pair<int, float> > fields;
+    bool weighted = false;
+    long n_self_loops = 0;
+    int n_vertices = 0;
+    char line[4096];
+    long line_number = 0;
+    while (fgets(line, sizeof(line), in)) {
+	line_number++;
+	char *p = line;
+	while (*p == ' ' || *p == '\t') p++;
+	if (*p == '#' || *p == '%' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+
+	char *end;
+	if (*p == 'h') {
+	    long v = strtol(p+1, &end, 10);
+	    char *value_end;
+	    float value = strtof(end, &value_end);
+	    if (end == p+1 || value_end == end || v < 0 || v >= INT_MAX) {
+		cout << "Error: Bad field on line " << line_number << " of " << input << endl;
+		exit(1);
+	    }
+	    fields.push_back(make_pair((int)v, value));
+	    n_vertices = max(n_vertices, (int)v+1);
+	    weighted = true;
+	    continue;
+	}
+	long u = strtol(p, &end, 10);
+	char *v_end;
+	long v = strtol(end, &v_end, 10);
+	if (end == p || v_end == end || u < 0 || v < 0 || u >= INT_MAX || v >= INT_MAX) {
+	    cout << "Error: Bad edge on line " << line_number << " of " << input << endl;
+	    exit(1);
+	}
+	char *weight_end;
+	float weight = strtof(v_end, &weight_end);
+	if (weight_end == v_end) weight = 1;
+	else weighted = true;
+	n_vertices = max(n_vertices, (int)max(u, v)+1);
+	if (u == v) {
+	    n_self_loops++;
+	    continue;
+	}
+	edges.push_back(make_pair((int)u, (int)v));
+	weights.push_back(weight);
+	if (2 * edges.size() > INT_MAX) {
+	    cout << "Error: " << input << " has too many edges." << endl;
+	    exit(1);
 	}
     }
-    return 1; // 1 batch for hogwild.
-}
+    fclose(in);
+    if (n_self_loops > 0) {
+	cerr << "Warning: Skipped " << n_self_loops << " self loops." << endl;
+    }
 
-void UpdateState(Graph &g, vector<int> &state, int index) {
-    int product_with_1 = 0;
-    int product_with_neg_1 = 0;
-    for (int i = 0; i < g[index].size(); i++) {
-	product_with_1 += state[g[index][i]];
-	product_with_neg_1 += state[g[index][i]] * -1;
+    vector<float> couplings;
+    Graph g = BuildGraphFromEdges(n_vertices, edges, weights, &couplings);
+    vector<float> field(n_vertices, 0);
+    for (int i = 0; i < fields.size(); i++) field[fields[i].first] = fields[i].second;
+
+    GraphFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GRAPH_FILE_MAGIC, 8);
+    header.version = GRAPH_FILE_VERSION;
+    header.flags = weighted ? GRAPH_FILE_WEIGHTED : 0;
+    header.n_vertices = n_vertices;
+    header.n_entries = g.neighbors.size();
+    uint64_t position = sizeof(header);
+    header.offsets_start = position;
+    position = (position + (n_vertices+1) * sizeof(int) + 63) / 64 * 64;
+    header.neighbors_start = position;
+    position = (position + g.neighbors.size() * sizeof(int) + 63) / 64 * 64;
+    if (weighted) {
+	header.edges_start = position;
+	position = (position + g.neighbors.size() * sizeof(WeightedEdge) + 63) / 64 * 64;
+	header.field_start = position;
     }
 
-    double p1 = exp(BETA * (double)product_with_1);
-    double p2 = exp(BETA * (double)product_with_neg_1);
-    double prob_1 = p1 / (p1+p2);
-    double selection = ((double)rand() / (RAND_MAX));
-    if (selection <= prob_1) {
-	state[index] = 1;
+    FILE *out = fopen(output.c_str(), "wb");
+    if (!out) {
+	cout << "Error: Could not create graph file " << output << endl;
+	exit(1);
     }
-    else {
-	state[index] = -1;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    // Zero padding up to each section start.
+    char padding[64] = {0};
+    ok = ok && fwrite(padding, 1, header.offsets_start - sizeof(header), out) == header.offsets_start - sizeof(header);
+    ok = ok && fwrite(g.offsets.begin(), sizeof(int), g.offsets.size(), out) == g.offsets.size();
+    ok = ok && fseek(out, header.neighbors_start, SEEK_SET) == 0;
+    ok = ok && fwrite(g.neighbors.begin(), sizeof(int), g.neighbors.size(), out) == g.neighbors.size();
+    if (weighted) {
+	vector<WeightedEdge> weighted_edges(g.neighbors.size());
+	for (int i = 0; i < weighted_edges.size(); i++) {
+	    weighted_edges[i].neighbor = g.neighbors[i];
+	    weighted_edges[i].coupling = couplings[i];
+	}
+	ok = ok && fseek(out, header.edges_start, SEEK_SET) == 0;
+	ok = ok && fwrite(weighted_edges.data(), sizeof(WeightedEdge), weighted_edges.size(), out) == weighted_edges.size();
+	ok = ok && fseek(out, header.field_start, SEEK_SET) == 0;
+	ok = ok && fwrite(field.data(), sizeof(float), field.size(), out) == field.size();
     }
+    ok = fclose(out) == 0 && ok;
+    if (!ok) {
+	cout << "Error: Could not write graph file " << output << endl;
+	exit(1);
+    }
+    printf("Wrote %d vertices and %zu edges%s to %s\n", n_vertices, edges.size(),
+	   weighted ? " with weights" : "", output.c_str());
 }
 
-int main(int argc, char *argv[]) {
-    omp_set_num_threads(N_THREADS);
-
-    // Generate graph.
-    //Graph g = GenerateRandomIsingModelGraph();
-    Graph g = Generate2DIsingModelGraph();
-    PrintGraphStatistics(g);
+// Standard normal from two counter-based uniforms (Box-Muller).
+double RandomGaussian(uint64_t seed, uint32_t key, uint32_t stream) {
+    double u1 = RandomUniform(seed, key, 0, stream);
+    double u2 = RandomUniform(seed, key, 1, stream);
+    return sqrt(-2.0 * log(1.0 - u1)) * cos(2.0 * M_PI * u2);
+}
 
-    // Generate variables.
-    vector<int> state = GenerateIsingState();
+// Attach couplings and fields to g. J_ij is drawn once per edge from
+// N(1, coupling_sigma^2) and h_i from N(field_mean, field_sigma^2).
+WeightedGraph BuildWeightedGraph(Graph &g) {
+    WeightedGraph w;
+    int n = g.offsets.size() - 1;
+    w.offsets = g.offsets;
+    w.edges.resize(g.neighbors.size());
+    w.field.resize(n);
+    for (int i = 0; i < n; i++) {
+	w.field[i] = config.field_mean + config.field_sigma * RandomGaussian(config.seed, i, 2);
+	for (int j = g.offsets[i]; j < g.offsets[i+1]; j++) {
+	    w.edges[j].neighbor = g.neighbors[j];
+	    // Key each undirected edge by its position in the lower
+	    // endpoint's list so both directions get the same coupling.
+	    int u = min(i, g.neighbors[j]), v = max(i, g.neighbors[j]);
+	    int position = g.offsets[u];
+	    while (g.neighbors[position] != v) position++;
+	    w.edges[j].coupling = 1.0 + config.coupling_sigma * RandomGaussian(config.seed, position, 3);
+	}
+    }
+    return w;
+}
 
-    // Access pattern partitions.
-    // Of form [thread][batch][state to update].
-    // Note that for hogwild, there will only be one batch
-    AccessPattern access_pattern;
-    int n_batches = 0;
-    if (HOGWILD) {
-	n_batches = PartitionDatapointsForHogwild(g, state, access_pattern);
+// Vertices in breadth-first order, one component after another. For
+// Cuthill-McKee each component starts from a vertex of least degree and
+// neighbors are visited in order of increasing degree; the reverse of
+// that order (RCM) keeps the bandwidth of the adjacency matrix small.
+vector<int> BreadthFirstOrder(Graph &g, bool cuthill_mckee) {
+    int n = g.offsets.size() - 1;
+    vector<int> starts(n);
+    for (int v = 0; v < n; v++) starts[v] = v;
+    if (cuthill_mckee) {
+	stable_sort(starts.begin(), starts.end(), [&](int a, int b) { return Degree(g, a) < Degree(g, b); });
+    }
+    vector<int> order;
+    order.reserve(n);
+    vector<char> visited(n, 0);
+    vector<int> children;
+    for (int i = 0; i < n; i++) {
+	if (visited[starts[i]]) continue;
+	visited[starts[i]] = 1;
+	order.push_back(starts[i]);
+	for (size_t head = order.size() - 1; head < order.size(); head++) {
+	    int v = order[head];
+	    children.clear();
+	    for (int j = g.offsets[v]; j < g.offsets[v+1]; j++) {
+		int w = g.neighbors[j];
+		if (visited[w]) continue;
+		visited[w] = 1;
+		children.push_back(w);
+	    }
+	    if (cuthill_mckee) {
+		stable_sort(children.begin(), children.end(), [&](int a, int b) { return Degree(g, a) < Degree(g, b); });
+	    }
+	    order.insert(order.end(), children.begin(), children.end());
+	}
     }
+    if (cuthill_mckee) reverse(order.begin(), order.end());
+    return order;
+}
 
-    for (int iter = 0; iter < N_ITERATIONS; iter++) {
-	Print2DState(state);
-#pragma omp parallel for num_threads(N_THREADS)
-	for (int thread = 0; thread < N_THREADS; thread++) {
-	    for (int batch = 0; batch < n_batches; batch++) {
-		for (int to_update = 0; to_update < access_pattern[thread][batch].size(); to_update++) {
-		    int index_to_update = access_pattern[thread][batch][to_update];
-		    UpdateState(g, state, index_to_update);
-		}
+// Lattice sites along the Z-order curve, which keeps nearby sites in
+// nearby indices along both axes.
+vector<int> MortonOrder(int length) {
+    vector<pair<uint64_t, int> > keys(length * length);
+    for (int i = 0; i < length; i++) {
+	for (int j = 0; j < length; j++) {
+	    uint64_t key = 0;
+	    for (int bit = 0; bit < 32; bit++) {
+		key |= (uint64_t)((i >> bit) & 1) << (2*bit + 1);
+		key |= (uint64_t)((j >> bit) & 1) << (2*bit);
 	    }
+	    keys[i*length+j] = make_pair(key, i*length+j);
 	}
     }
+    sort(keys.begin(), keys.end());
+    vector<int> order(keys.size());
+    for (int i = 0; i < keys.size(); i++) order[i] = keys[i].second;
+    return order;
+}
+
+// Mean |v - w| over the adjacency entries, a rough measure of how far
+// apart in memory an update's neighbors are.
+double MeanNeighborDistance(Graph &g) {
+    double total = 0;
+    for (int v = 0; v + 1 < g.offsets.size(); v++) {
+	for (int j = g.offsets[v]; j < g.offsets[v+1]; j++) total += abs(g.neighbors[j] - v);
+    }
+    return g.neighbors.size() > 0 ? total / g.neighbors.size() : 0;
+}
+
+// Graph with vertex order[u] renamed u, so relabel[order[u]] == u. Each
+// vertex keeps its neighbors in the same order.
+template <typename Entry, typename Rename>
+void RelabelAdjacency(const Array<int> &offsets, const Array<Entry> &entries, const vector<int> &order,
+		      Array<int> &new_offsets, Array<Entry> &new_entries, Rename rename) {
+    int n = order.size();
+    new_offsets.assign(n+1, 0);
+    for (int u = 0; u < n; u++) {
+	new_offsets[u+1] = new_offsets[u] + offsets[order[u]+1] - offsets[order[u]];
+    }
+    new_entries.resize(entries.size());
+#pragma omp parallel for
+    for (int u = 0; u < n; u++) {
+	int position = new_offsets[u];
+	for (int j = offsets[order[u]]; j < offsets[order[u]+1]; j++) {
+	    new_entries[position++] = rename(entries[j]);
+	}
+    }
+}
+
+// Uniformly random labels in [0, potts_q).
+vector<int> GeneratePottsState() {
+    vector<int> state(config.n);
+    for (int i = 0; i < config.n; i++) {
+	state[i] = rand() % config.potts_q;
+    }
+    return state;
+}
+
+vector<int> GenerateIsingState() {
+    vector<int> state(config.n);
+    int n_ones = 0, n_negs = 0;
+    for (int i = 0; i < config.n; i++) {
+	if (rand() % 2 == 0) {
+	    state[i] = 1;
+	    n_ones++;
+	}
+	else {
+	    state[i] = -1;
+	    n_negs++;
+	}
+    }
+    return state;
+}
+
+// Packed spin state: one bit per vertex, set for +1. Vertex i is bit
+// i % 64 of words[i / 64].
+struct PackedState {
+    int n;
+    vector<uint64_t> words;
+};
+
+PackedState PackState(const vector<int> &state) {
+    PackedState packed;
+    packed.n = state.size();
+    packed.words.assign((state.size() + 63) / 64, 0);
+    for (int i = 0; i < state.size(); i++) {
+	if (state[i] == 1) packed.words[i >> 6] |= 1ULL << (i & 63);
+    }
+    return packed;
+}
+
+vector<int> UnpackState(const PackedState &packed) {
+    vector<int> state(packed.n);
+    for (int i = 0; i < packed.n; i++) {
+	state[i] = ((packed.words[i >> 6] >> (i & 63)) & 1) ? 1 : -1;
+    }
+    return state;
+}
+
+// Split the vertices into contiguous ranges, one per thread. With
+// alignment > 1 every range starts at a multiple of alignment, which
+// keeps threads from sharing words of a packed state.
+int PartitionDatapointsForHogwild(Graph &g, vector<int> &state, AccessPattern &pattern, int alignment = 1) {
+    pattern.clear();
+    pattern.resize(config.n_threads);
+    int n_datapoints_per_thread = config.n / config.n_threads;
+    n_datapoints_per_thread = (n_datapoints_per_thread + alignment - 1) / alignment * alignment;
+    for (int thread = 0; thread < config.n_threads; thread++) {
+	pattern[thread].resize(1);
+	int start = min(config.n, n_datapoints_per_thread * thread);
+	int end = min(config.n, n_datapoints_per_thread * (thread+1));
+	if (thread == config.n_threads-1) end = config.n;
+	for (int index = start; index < end; index++) {
+	    pattern[thread][0].push_back(index);
+	}
+    }
+    return 1; // 1 batch for hogwild.
+}
+
+// Checkerboard partitioning for the 2D lattice. The lattice is bipartite,
+// so batch 0 holds the even sites ((i+j) % 2 == 0) and batch 1 the odd
+// ones. No two sites in a batch are adjacent, which makes the schedule
+// an exact Gibbs sweep at any thread count. Each thread gets a
+// contiguous band of rows.
+int PartitionDatapointsForCheckerboard(Graph &g, vector<int> &state, AccessPattern &pattern) {
+    int length = (int)sqrt(config.n);
+    pattern.clear();
+    pattern.resize(config.n_threads);
+    for (int thread = 0; thread < config.n_threads; thread++) {
+	pattern[thread].resize(2);
+	int start_row = (long long)length * thread / config.n_threads;
+	int end_row = (long long)length * (thread+1) / config.n_threads;
+	for (int color = 0; color < 2; color++) {
+	    for (int i = start_row; i < end_row; i++) {
+		for (int j = (i + color) & 1; j < length; j += 2) {
+		    pattern[thread][color].push_back(i*length+j);
+		}
+	    }
+	}
+    }
+    return 2;
+}
+
+// Union-find that many threads may update at once. Roots are only ever
+// linked below smaller roots, by compare-and-swap, so every tree's root is
+// its smallest element whatever the order of the unions. Path halving
+// races are benign: parent[x] only ever moves to another ancestor of x.
+// Every access to parent is atomic, relaxed as in UpdatePackedState.
+int ConcurrentFindRoot(vector<int> &parent, int x) {
+    int next;
+    while ((next = __atomic_load_n(&parent[x], __ATOMIC_RELAXED)) != x) {
+	int grandparent = __atomic_load_n(&parent[next], __ATOMIC_RELAXED);
+	// x is not a root, so no link can race with this store.
+	if (grandparent != next) __atomic_store_n(&parent[x], grandparent, __ATOMIC_RELAXED);
+	x = next;
+    }
+    return x;
+}
+
+void ConcurrentUnion(vector<int> &parent, int x, int y) {
+    while (true) {
+	x = ConcurrentFindRoot(parent, x);
+	y = ConcurrentFindRoot(parent, y);
+	if (x == y) return;
+	if (x > y) swap(x, y);
+	// Fails if y stopped being a root meanwhile, then retry from there.
+	if (__sync_bool_compare_and_swap(&parent[y], y, x)) return;
+    }
+}
+
+// Connected components of the subgraph of g induced by sampled[0..n_sampled),
+// found in parallel with ConcurrentUnion. Sets root[i] to the smallest
+// index in sampled[i]'s component, the same labels the serial Union gives.
+// position must be -1 for every vertex on entry and is left that way.
+// position, parent and root are preallocated by the caller.
+void SampledComponents(Graph &g, const int *sampled, int n_sampled, vector<int> &position,
+		       vector<int> &parent, vector<int> &root, int n_threads) {
+#pragma omp parallel num_threads(n_threads)
+    {
+#pragma omp for schedule(static)
+	for (int i = 0; i < n_sampled; i++) {
+	    position[sampled[i]] = i;
+	    parent[i] = i;
+	}
+
+	// Each conflict is seen from both ends, so union from the smaller.
+#pragma omp for schedule(dynamic, 1024)
+	for (int i = 0; i < n_sampled; i++) {
+	    int vertex = sampled[i];
+	    for (int j = g.offsets[vertex]; j < g.offsets[vertex+1]; j++) {
+		int neighbor_position = position[g.neighbors[j]];
+		if (neighbor_position > i) ConcurrentUnion(parent, i, neighbor_position);
+	    }
+	}
+
+#pragma omp for schedule(static)
+	for (int i = 0; i < n_sampled; i++) root[i] = ConcurrentFindRoot(parent, i);
+
+#pragma omp for schedule(static)
+	for (int i = 0; i < n_sampled; i++) position[sampled[i]] = -1;
+    }
+}
+
+// Greedily place each component of sampled[0..n_sampled) on the least
+// loaded of load.size() threads, calling place(thread, vertex) for every
+// vertex. Components are discovered in increasing root order, and every
+// root precedes the members of its component. component_thread is scratch.
+template <typename Place>
+void AssignComponents(const int *sampled, int n_sampled, const vector<int> &root, vector<int> &component_thread,
+		      vector<int> &load, Place place) {
+    fill(load.begin(), load.end(), 0);
+    for (int i = 0; i < n_sampled; i++) {
+	if (root[i] == i) {
+	    int target = min_element(load.begin(), load.end()) - load.begin();
+	    component_thread[i] = target;
+	}
+	int thread = component_thread[root[i]];
+	place(thread, sampled[i]);
+	load[thread]++;
+    }
+}
+
+// config.cyclades_batch_size, or N/(2*DELTA) if unset.
+int CycladesBatchSize() {
+    int batch_size = config.cyclades_batch_size;
+    if (batch_size <= 0) batch_size = max(1, config.n / (2*config.delta));
+    return batch_size;
+}
+
+// Seconds the last Cyclades partitioning spent finding the components of
+// every batch and assigning them to threads.
+struct CycladesTiming {
+    int n_batches;
+    double components;
+    double assignment;
+
+    CycladesTiming() : n_batches(0), components(0), assignment(0) {}
+};
+
+// Cyclades partitioning. The vertices are shuffled and cut into batches
+// of config.cyclades_batch_size. Within each batch, two sampled vertices conflict
+// if they are adjacent in g. Connected components of this conflict graph
+// are assigned whole to the currently least loaded thread, so no two
+// threads touch adjacent vertices within the same batch. Batches must be
+// separated by a barrier.
+int PartitionDatapointsForCyclades(Graph &g, vector<int> &state, AccessPattern &pattern, CycladesTiming &timing) {
+    vector<int> order(config.n);
+    for (int i = 0; i < config.n; i++) order[i] = i;
+    for (int i = config.n-1; i > 0; i--) {
+	swap(order[i], order[rand() % (i+1)]);
+    }
+
+    int batch_size = CycladesBatchSize();
+    int n_batches = (config.n + batch_size - 1) / batch_size;
+    pattern.clear();
+    pattern.resize(config.n_threads);
+    for (int thread = 0; thread < config.n_threads; thread++) {
+	pattern[thread].resize(n_batches);
+    }
+
+    // Position of each vertex within the current batch, -1 if not sampled.
+    // The buffers are reused by every batch.
+    vector<int> position(config.n, -1);
+    vector<int> parent(batch_size);
+    vector<int> root(batch_size);
+    vector<int> component_thread(batch_size);
+    vector<int> load(config.n_threads);
+    timing = CycladesTiming();
+    timing.n_batches = n_batches;
+    for (int batch = 0; batch < n_batches; batch++) {
+	int start = batch * batch_size;
+	int end = min(config.n, start + batch_size);
+	int n_sampled = end - start;
+	double components_start = omp_get_wtime();
+	SampledComponents(g, &order[start], n_sampled, position, parent, root, config.n_threads);
+	double assignment_start = omp_get_wtime();
+
+	AssignComponents(&order[start], n_sampled, root, component_thread, load, [&](int thread, int vertex) {
+	    pattern[thread][batch].push_back(vertex);
+	});
+	timing.components += assignment_start - components_start;
+	timing.assignment += omp_get_wtime() - assignment_start;
+    }
+    return n_batches;
+}
+
+// Pipelined Cyclades schedule, see PipelinedSweep. Every sweep draws a new
+// random order of the vertices, so batches are planned as the sweep runs.
+// All buffers are sized once and reused, so planning does not allocate in
+// steady state.
+struct CycladesPipeline {
+    vector<int> order;                      // The sweep's shuffle so far
+    vector<int> position, parent, root, component_thread, load;
+    vector<vector<int> > buffers[2];        // [buffer][thread] vertices to update
+    // Buffer already holding batch 0 of planned_sweep for planned_threads
+    // workers, planned during the previous sweep. -1 if none.
+    int planned_buffer, planned_sweep, planned_threads;
+
+    // Seconds spent planning, seconds of worker time spent updating, and
+    // wall-clock seconds of the pipelined sweeps.
+    double planning, working, elapsed;
+    long long n_planned;
+
+    CycladesPipeline() : planned_buffer(-1), planned_sweep(0), planned_threads(0),
+			 planning(0), working(0), elapsed(0), n_planned(0) {}
+};
+
+// Plan batch of sweep into pattern[thread] for load.size() threads, on the
+// calling thread alone. The batch's vertices are the next steps of a
+// Fisher-Yates shuffle keyed by (seed, sweep) from stream 14, so the
+// schedule depends only on the seed, the sweep and the thread count.
+void PlanCycladesBatch(Graph &g, CycladesPipeline &p, int sweep, int batch, vector<vector<int> > &pattern) {
+    double start_time = omp_get_wtime();
+    int n = config.n, batch_size = CycladesBatchSize();
+    int start = batch * batch_size, n_sampled = min(n, start + batch_size) - start;
+    if (batch == 0) {
+	for (int i = 0; i < n; i++) p.order[i] = i;
+    }
+    for (int i = start; i < start + n_sampled; i++) {
+	swap(p.order[i], p.order[i + RandomBelow(RandomBits(config.seed, i, sweep, 14), n - i)]);
+    }
+    SampledComponents(g, &p.order[start], n_sampled, p.position, p.parent, p.root, 1);
+    for (int thread = 0; thread < pattern.size(); thread++) pattern[thread].clear();
+    AssignComponents(&p.order[start], n_sampled, p.root, p.component_thread, p.load, [&](int thread, int vertex) {
+	pattern[thread].push_back(vertex);
+    });
+    p.planning += omp_get_wtime() - start_time;
+    p.n_planned++;
+}
+
+// P(x = +1 | neighbor sum) for every neighbor sum in [-max_degree,
+// max_degree], so the update needs no transcendental math. With sum s,
+// the conditional is exp(beta*s) / (exp(beta*s) + exp(-beta*s)).
+// The probabilities are stored as 32-bit thresholds: a spin becomes +1
+// when RandomBits(...) < threshold, which scalar and SIMD kernels both
+// evaluate exactly.
+struct ConditionalTable {
+    double beta;
+    int max_degree;
+    vector<uint32_t> threshold;     // Indexed by sum + max_degree
+    uint32_t bond_threshold;        // Cluster bond probability 1 - exp(-2*beta)
+};
+
+int MaxDegree(Graph &g) {
+    int max_degree = 0;
+    for (int i = 0; i+1 < g.offsets.size(); i++) {
+	max_degree = max(max_degree, Degree(g, i));
+    }
+    return max_degree;
+}
+
+// (Re)build table for beta. Cheap to call every sweep when annealing:
+// it does nothing unless beta or the degree bound changed.
+void BuildConditionalTable(ConditionalTable &table, double beta, int max_degree) {
+    if (!table.threshold.empty() && table.beta == beta && table.max_degree == max_degree) {
+	return;
+    }
+    table.beta = beta;
+    table.max_degree = max_degree;
+    table.threshold.resize(2*max_degree+1);
+    for (int sum = -max_degree; sum <= max_degree; sum++) {
+	double prob_1 = 1.0 / (1.0 + exp(-2.0 * beta * sum));
+	table.threshold[sum+max_degree] = (uint32_t)min(4294967295.0, floor(prob_1 * 4294967296.0));
+    }
+    table.bond_threshold = (uint32_t)min(4294967295.0, floor(-expm1(-2.0 * beta) * 4294967296.0));
+}
+
+// Running magnetization sum_i x_i and energy -sum_{(i,j)} J_ij x_i x_j -
+// sum_i h_i x_i (J = 1, h = 0 unless weighted). Kernels add the change
+// from each update to a per-thread Observables, which is O(1) per update:
+// setting x_i from old to new with local field s = sum_j J_ij x_j + h_i
+// changes them by (new-old) and -(new-old)*s.
+struct Observables {
+    long long magnetization;
+    double energy;
+
+    Observables() : magnetization(0), energy(0) {}
+
+    void Add(int old_spin, int new_spin, double local_field) {
+	magnetization += new_spin - old_spin;
+	energy -= (new_spin - old_spin) * local_field;
+    }
+};
+
+// Resample vertex index from its conditional. The random number is drawn
+// from the counter-based stream for (index, sweep), so results depend only
+// on the seed and the order of conflicting updates.
+void UpdateState(Graph &g, vector<int> &state, ConditionalTable &table, int index, int sweep, Observables &delta) {
+    int product_with_1 = 0;
+    const int *neighbors = &g.neighbors[0];
+    for (int i = g.offsets[index]; i < g.offsets[index+1]; i++) {
+	product_with_1 += state[neighbors[i]];
+    }
+
+    int old_spin = state[index];
+    uint32_t threshold = table.threshold[product_with_1 + table.max_degree];
+    if (RandomBits(config.seed, index, sweep, 0) < threshold) {
+	state[index] = 1;
+    }
+    else {
+	state[index] = -1;
+    }
+    delta.Add(old_spin, state[index], product_with_1);
+}
+
+// UpdateState for the weighted model. P(x = +1) is
+// 1 / (1 + exp(-2 * beta * local_field)), which varies continuously, so it
+// is evaluated directly in single precision rather than tabulated. The
+// loop is a branch-free multiply-add over interleaved (neighbor, coupling)
+// pairs and the accept is a select, so the compiler can vectorize it.
+void UpdateWeightedState(WeightedGraph &g, vector<int> &state, float beta, int index, int sweep, Observables &delta) {
+    const WeightedEdge *edges = &g.edges[0];
+    float local_field = g.field[index];
+    for (int i = g.offsets[index]; i < g.offsets[index+1]; i++) {
+	local_field += edges[i].coupling * state[edges[i].neighbor];
+    }
+
+    int old_spin = state[index];
+    float prob_1 = 1.0f / (1.0f + expf(-2.0f * beta * local_field));
+    float selection = RandomBits(config.seed, index, sweep, 0) * (1.0f / 4294967296.0f);
+    int new_spin = selection < prob_1 ? 1 : -1;
+    state[index] = new_spin;
+    delta.Add(old_spin, new_spin, local_field);
+}
+
+// q-state discrete pairwise model with energy -sum_{(i,j)} W[x_i][x_j].
+// The Potts interaction is W[a][b] = (a == b); the clock interaction is
+// W[a][b] = cos(2 pi (a - b) / q). W is symmetric and stored so that
+// interaction[b*q + a] = W[a][b]: a neighbor with label b adds one
+// contiguous row to the per-label scores.
+struct PottsModel {
+    int q;
+    double beta;
+    vector<float> interaction;
+    // For the Potts interaction every score is a neighbor count, so
+    // exp(-beta * k) is tabulated for k = best count - count up to
+    // max_degree, which cannot overflow however large beta * degree is.
+    bool integer_scores;
+    vector<float> count_weight;
+};
+
+void BuildPottsModel(PottsModel &model, int q, PottsInteraction interaction, double beta, int max_degree) {
+    model.q = q;
+    model.beta = beta;
+    model.integer_scores = interaction == POTTS_INTERACTION;
+    model.interaction.resize(q*q);
+    for (int a = 0; a < q; a++) {
+	for (int b = 0; b < q; b++) {
+	    model.interaction[b*q+a] = interaction == POTTS_INTERACTION ?
+		(a == b) : cos(2.0 * M_PI * (a - b) / q);
+	}
+    }
+    model.count_weight.resize(max_degree+1);
+    for (int count = 0; count <= max_degree; count++) {
+	model.count_weight[count] = exp(-beta * count);
+    }
+}
+
+// Resample vertex index of a Potts model. Scores sum_j W[a][x_j] are
+// accumulated per label, turned into unnormalized weights exp(beta *
+// score), and a label is drawn by inverting their cumulative sum with one
+// uniform. The running magnetization counts label 0 vertices.
+void UpdatePottsState(Graph &g, vector<int> &state, PottsModel &model, int index, int sweep, Observables &delta) {
+    int q = model.q;
+    float scores[MAX_POTTS_STATES];
+    float cumulative[MAX_POTTS_STATES];
+    for (int a = 0; a < q; a++) scores[a] = 0;
+    const int *neighbors = &g.neighbors[0];
+    for (int i = g.offsets[index]; i < g.offsets[index+1]; i++) {
+	const float *row = &model.interaction[state[neighbors[i]] * q];
+	for (int a = 0; a < q; a++) scores[a] += row[a];
+    }
+
+    // Subtract the best score so the largest weight is exactly 1.
+    float best = scores[0];
+    for (int a = 1; a < q; a++) best = max(best, scores[a]);
+    float total = 0;
+    if (model.integer_scores) {
+	for (int a = 0; a < q; a++) {
+	    total += model.count_weight[(int)(best - scores[a])];
+	    cumulative[a] = total;
+	}
+    }
+    else {
+	for (int a = 0; a < q; a++) {
+	    total += expf(model.beta * (scores[a] - best));
+	    cumulative[a] = total;
+	}
+    }
+
+    float selection = RandomBits(config.seed, index, sweep, 0) * (1.0f / 4294967296.0f) * total;
+    int new_label = 0;
+    while (new_label < q-1 && cumulative[new_label] <= selection) new_label++;
+
+    int old_label = state[index];
+    state[index] = new_label;
+    delta.magnetization += (new_label == 0) - (old_label == 0);
+    delta.energy -= scores[new_label] - scores[old_label];
+}
+
+void PrintUsage(const char *program) {
+    printf("Usage: %s [--option=value ...]\n", program);
+    printf("  --config=FILE           Read option=value lines from FILE\n");
+    printf("  --n=INT                 Number of vertices (default %d)\n", Config().n);
+    printf("  --delta=INT             Maximum degree of vertices (default %d)\n", Config().delta);
+    printf("  --beta=FLOAT            Inverse temperature (default %g)\n", Config().beta);
+    printf("  --threads=INT           Number of threads (default %d)\n", Config().n_threads);
+    printf("  --iterations=INT        Number of sweeps (default %d)\n", Config().n_iterations);
+    printf("  --mode=MODE             hogwild, cyclades, checkerboard, swendsen-wang or wolff (default hogwild)\n");
+    printf("  --graph=2d|random|file  Graph to sample on (default 2d)\n");
+    printf("  --graph-file=FILE       Binary graph to map for --graph=file\n");
+    printf("  --convert-edge-list=FILE  Convert a text edge list to --graph-file and exit\n");
+    printf("  --state=int|packed      Spin storage, packed uses one bit per spin\n");
+    printf("  --reorder=none|bfs|rcm|morton  Relabel vertices for locality before sampling\n");
+    printf("  --betas=LIST            Parallel tempering over these betas, e.g. 0.3,0.4,0.5\n");
+    printf("  --swap-interval=INT     Sweeps between tempering swap attempts (default 10)\n");
+    printf("  --multispin=0|1         Sample 64 independent Ising replicas per update\n");
+    printf("  --layout=shared|padded  Hogwild state layout, padded uses ghost copies\n");
+    printf("  --numa=0|1              Pin threads and place data on their NUMA nodes\n");
+    printf("  --potts=Q               Sample a Q-state model instead of Ising (Q <= %d)\n", MAX_POTTS_STATES);
+    printf("  --interaction=potts|clock  Pairwise factor between Potts labels\n");
+    printf("  --weighted=0|1          Use per-edge couplings and per-vertex fields\n");
+    printf("  --coupling-sigma=FLOAT  Weighted couplings are N(1, sigma^2)\n");
+    printf("  --field=FLOAT           Mean of the weighted fields\n");
+    printf("  --field-sigma=FLOAT     Standard deviation of the weighted fields\n");
+    printf("  --simd=LEVEL            Widest lattice kernel: scalar, avx2 or avx512 (default)\n");
+    printf("  --batch-size=INT        Cyclades batch size, 0 for N/(2*delta)\n");
+    printf("  --cyclades-pipeline=0|1  New Cyclades schedule every sweep, planned on an extra thread\n");
+    printf("  --wolff-clusters=INT    Clusters per Wolff sweep, 0 to calibrate to about N flipped spins\n");
+    printf("  --checkpoint-file=FILE  Checkpoint the chain to FILE at the end of the run\n");
+    printf("  --checkpoint-interval=INT  Also checkpoint every INT sweeps\n");
+    printf("  --resume=0|1            Continue from --checkpoint-file if it exists\n");
+    printf("  --snapshot-interval=INT Write the state every INT sweeps, 0 for never\n");
+    printf("  --snapshot-file=FILE    Write snapshots to FILE instead of stdout\n");
+    printf("  --snapshot-format=text|binary  Text, or a compressed seekable sample file\n");
+    printf("  --verify-snapshots=0|1  Read the sample file back at the end and check every snapshot\n");
+    printf("  --read-snapshots=FILE   Print a snapshot from a binary sample file and exit\n");
+    printf("  --read-iteration=INT    Snapshot to print, the last at or before INT (default last)\n");
+    printf("  --seed=INT              Master random seed (default 0)\n");
+    printf("  --diagnostics-interval=INT  Report magnetization, energy and ESS every INT sweeps\n");
+    printf("  --burn-in=INT           Sweeps to skip before recording diagnostics\n");
+    printf("  --target-ess=FLOAT      Stop once both observables reach this ESS\n");
+    printf("  --tolerance=FLOAT       Stop once both standard errors are below this\n");
+    printf("  --benchmark-threads=T,..  Time --iterations sweeps at each thread count\n");
+    printf("  --benchmark-format=csv|json  Benchmark output format (default csv)\n");
+    printf("  --benchmark-output=FILE Append benchmark results to FILE\n");
+}
+
+int ParseInt(const string &name, const string &value) {
+    char *end;
+    long result = strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || result < INT_MIN || result > INT_MAX) {
+	cout << "Error: Invalid integer for " << name << ": " << value << endl;
+	exit(1);
+    }
+    return (int)result;
+}
+
+double ParseDouble(const string &name, const string &value) {
+    char *end;
+    double result = strtod(value.c_str(), &end);
+    if (value.empty() || *end != '\0') {
+	cout << "Error: Invalid number for " << name << ": " << value << endl;
+	exit(1);
+    }
+    return result;
+}
+
+uint64_t ParseSeed(const string &name, const string &value) {
+    char *end;
+    unsigned long long result = strtoull(value.c_str(), &end, 10);
+    if (value.empty() || value[0] == '-' || *end != '\0') {
+	cout << "Error: Invalid seed for " << name << ": " << value << endl;
+	exit(1);
+    }
+    return (uint64_t)result;
+}
+
+void LoadConfigFile(Config &c, const string &path);
+
+// Apply a single name=value setting to c.
+void SetConfigOption(Config &c, const string &name, const string &value) {
+    if (name == "config") LoadConfigFile(c, value);
+    else if (name == "n") c.n = ParseInt(name, value);
+    else if (name == "delta") c.delta = ParseInt(name, value);
+    else if (name == "beta") c.beta = ParseDouble(name, value);
+    else if (name == "threads") c.n_threads = ParseInt(name, value);
+    else if (name == "iterations") c.n_iterations = ParseInt(name, value);
+    else if (name == "batch-size") c.cyclades_batch_size = ParseInt(name, value);
+    else if (name == "cyclades-pipeline") c.cyclades_pipeline = ParseInt(name, value) != 0;
+    else if (name == "wolff-clusters") c.wolff_clusters = ParseInt(name, value);
+    else if (name == "checkpoint-file") c.checkpoint_file = value;
+    else if (name == "checkpoint-interval") c.checkpoint_interval = ParseInt(name, value);
+    else if (name == "resume") c.resume = ParseInt(name, value) != 0;
+    else if (name == "snapshot-interval") c.snapshot_interval = ParseInt(name, value);
+    else if (name == "snapshot-file") c.snapshot_file = value;
+    else if (name == "verify-snapshots") c.verify_snapshots = ParseInt(name, value) != 0;
+    else if (name == "snapshot-format") {
+	if (value == "text") c.snapshot_binary = false;
+	else if (value == "binary") c.snapshot_binary = true;
+	else {
+	    cout << "Error: Unknown snapshot format " << value << endl;
+	    exit(1);
+	}
+    }
+    else if (name == "read-snapshots") c.read_snapshots = value;
+    else if (name == "read-iteration") c.read_iteration = ParseInt(name, value);
+    else if (name == "seed") c.seed = ParseSeed(name, value);
+    else if (name == "benchmark-threads") {
+	c.benchmark_threads.clear();
+	size_t start = 0;
+	while (start <= value.size()) {
+	    size_t comma = value.find(',', start);
+	    if (comma == string::npos) comma = value.size();
+	    c.benchmark_threads.push_back(ParseInt(name, value.substr(start, comma - start)));
+	    start = comma + 1;
+	}
+    }
+    else if (name == "betas") {
+	c.betas.clear();
+	size_t start = 0;
+	while (start <= value.size()) {
+	    size_t comma = value.find(',', start);
+	    if (comma == string::npos) comma = value.size();
+	    c.betas.push_back(ParseDouble(name, value.substr(start, comma - start)));
+	    start = comma + 1;
+	}
+	sort(c.betas.begin(), c.betas.end());
+    }
+    else if (name == "swap-interval") c.swap_interval = ParseInt(name, value);
+    else if (name == "benchmark-format") {
+	if (value == "csv") c.benchmark_json = false;
+	else if (value == "json") c.benchmark_json = true;
+	else {
+	    cout << "Error: Unknown benchmark format: " << value << endl;
+	    exit(1);
+	}
+    }
+    else if (name == "benchmark-output") c.benchmark_output = value;
+    else if (name == "diagnostics-interval") c.diagnostics_interval = ParseInt(name, value);
+    else if (name == "burn-in") c.burn_in = ParseInt(name, value);
+    else if (name == "target-ess") c.target_ess = ParseDouble(name, value);
+    else if (name == "tolerance") c.tolerance = ParseDouble(name, value);
+    else if (name == "mode") {
+	if (value == "hogwild") c.mode = HOGWILD;
+	else if (value == "cyclades") c.mode = CYCLADES;
+	else if (value == "checkerboard") c.mode = CHECKERBOARD;
+	else if (value == "swendsen-wang") c.mode = SWENDSEN_WANG;
+	else if (value == "wolff") c.mode = WOLFF;
+	else {
+	    cout << "Error: Unknown mode: " << value << endl;
+	    exit(1);
+	}
+    }
+    else if (name == "reorder") {
+	if (value == "none") c.reorder = NO_REORDER;
+	else if (value == "bfs") c.reorder = BFS_REORDER;
+	else if (value == "rcm") c.reorder = RCM_REORDER;
+	else if (value == "morton") c.reorder = MORTON_REORDER;
+	else {
+	    cout << "Error: Unknown reordering: " << value << endl;
+	    exit(1);
+	}
+    }
+    else if (name == "layout") {
+	if (value == "shared") c.layout = SHARED_LAYOUT;
+	else if (value == "padded") c.layout = PADDED_LAYOUT;
+	else {
+	    cout << "Error: Unknown state layout: " << value << endl;
+	    exit(1);
+	}
+    }
+    else if (name == "state") {
+	if (value == "int") c.packed_state = false;
+	else if (value == "packed") c.packed_state = true;
+	else {
+	    cout << "Error: Unknown state storage: " << value << endl;
+	    exit(1);
+	}
+    }
+    else if (name == "graph-file") c.graph_file = value;
+    else if (name == "convert-edge-list") c.convert_edge_list = value;
+    else if (name == "multispin") c.multispin = ParseInt(name, value) != 0;
+    else if (name == "numa") c.numa = ParseInt(name, value) != 0;
+    else if (name == "potts") c.potts_q = ParseInt(name, value);
+    else if (name == "interaction") {
+	if (value == "potts") c.potts_interaction = POTTS_INTERACTION;
+	else if (value == "clock") c.potts_interaction = CLOCK_INTERACTION;
+	else {
+	    cout << "Error: Unknown interaction: " << value << endl;
+	    exit(1);
+	}
+    }
+    else if (name == "weighted") c.weighted = ParseInt(name, value) != 0;
+    else if (name == "coupling-sigma") c.coupling_sigma = ParseDouble(name, value);
+    else if (name == "field") c.field_mean = ParseDouble(name, value);
+    else if (name == "field-sigma") c.field_sigma = ParseDouble(name, value);
+    else if (name == "simd") {
+	if (value == "scalar") c.simd = SIMD_SCALAR;
+	else if (value == "avx2") c.simd = SIMD_AVX2;
+	else if (value == "avx512") c.simd = SIMD_AVX512;
+	else {
+	    cout << "Error: Unknown SIMD level: " << value << endl;
+	    exit(1);
+	}
+    }
+    else if (name == "graph") {
+	if (value == "2d") c.graph = LATTICE_2D;
+	else if (value == "random") c.graph = RANDOM_GRAPH;
+	else if (value == "file") c.graph = GRAPH_FILE;
+	else {
+	    cout << "Error: Unknown graph: " << value << endl;
+	    exit(1);
+	}
+    }
+    else {
+	cout << "Error: Unknown option: " << name << endl;
+	exit(1);
+    }
+}
+
+// Config files hold one name=value per line, using the same names as
+// the command line flags. Blank lines and lines starting with # are
+// ignored.
+void LoadConfigFile(Config &c, const string &path) {
+    ifstream file(path.c_str());
+    if (!file) {
+	cout << "Error: Could not open config file " << path << endl;
+	exit(1);
+    }
+    string line;
+    while (getline(file, line)) {
+	size_t first = line.find_first_not_of(" \t\r");
+	if (first == string::npos || line[first] == '#') continue;
+	size_t equals = line.find('=');
+	if (equals == string::npos) {
+	    cout << "Error: Expected name=value in " << path << ": " << line << endl;
+	    exit(1);
+	}
+	string name = line.substr(first, equals - first);
+	string value = line.substr(equals+1);
+	name.erase(name.find_last_not_of(" \t") + 1);
+	value.erase(0, value.find_first_not_of(" \t"));
+	value.erase(value.find_last_not_of(" \t\r") + 1);
+	SetConfigOption(c, name, value);
+    }
+}
+
+Config ParseArguments(int argc, char *argv[]) {
+    Config c;
+    for (int i = 1; i < argc; i++) {
+	string arg = argv[i];
+	if (arg == "-h" || arg == "--help") {
+	    PrintUsage(argv[0]);
+	    exit(0);
+	}
+	size_t equals = arg.find('=');
+	if (arg.compare(0, 2, "--") != 0 || equals == string::npos) {
+	    cout << "Error: Expected --option=value, got " << arg << endl;
+	    PrintUsage(argv[0]);
+	    exit(1);
+	}
+	SetConfigOption(c, arg.substr(2, equals-2), arg.substr(equals+1));
+    }
+
+    if (c.n <= 0 || c.delta <= 0 || c.n_threads <= 0 ||
+	c.n_iterations < 0 || c.snapshot_interval < 0 || c.checkpoint_interval < 0 || c.diagnostics_interval < 0 ||
+	c.burn_in < 0 || c.target_ess < 0 || c.tolerance < 0) {
+	cout << "Error: n, delta and threads must be positive, other counts and thresholds non-negative." << endl;
+	exit(1);
+    }
+    for (int i = 0; i < c.benchmark_threads.size(); i++) {
+	if (c.benchmark_threads[i] <= 0) {
+	    cout << "Error: Benchmark thread counts must be positive." << endl;
+	    exit(1);
+	}
+    }
+    if ((c.resume || c.checkpoint_interval != 0) && c.checkpoint_file.empty()) {
+	cout << "Error: --resume and --checkpoint-interval need --checkpoint-file." << endl;
+	exit(1);
+    }
+    if (c.verify_snapshots && !c.snapshot_binary) {
+	cout << "Error: --verify-snapshots requires --snapshot-format=binary." << endl;
+	exit(1);
+    }
+    if (c.snapshot_binary && c.snapshot_file.empty()) {
+	cout << "Error: --snapshot-format=binary needs --snapshot-file." << endl;
+	exit(1);
+    }
+    if ((c.graph == GRAPH_FILE || !c.convert_edge_list.empty()) && c.graph_file.empty()) {
+	cout << "Error: --graph=file and --convert-edge-list need --graph-file." << endl;
+	exit(1);
+    }
+    if (c.potts_q != 0 && (c.potts_q < 2 || c.potts_q > MAX_POTTS_STATES)) {
+	cout << "Error: Potts models need between 2 and " << MAX_POTTS_STATES << " states." << endl;
+	exit(1);
+    }
+    if (c.potts_q > 0 && (c.packed_state || c.weighted)) {
+	cout << "Error: Potts models require --state=int and no --weighted." << endl;
+	exit(1);
+    }
+    if (!c.betas.empty() && (c.betas.size() < 2 || c.swap_interval <= 0)) {
+	cout << "Error: --betas needs at least two values and --swap-interval must be positive." << endl;
+	exit(1);
+    }
+    if (!c.betas.empty() && (c.multispin || !c.checkpoint_file.empty() || c.target_ess > 0 || c.tolerance > 0 ||
+			     !c.benchmark_threads.empty())) {
+	cout << "Error: --betas does not support --multispin, checkpoints, early stopping or benchmarks." << endl;
+	exit(1);
+    }
+    // PlaceSampler pins the calling thread's team, which for tempering is
+    // the main thread rather than each replica's group.
+    if (!c.betas.empty() && c.numa) {
+	cout << "Error: --betas does not support --numa." << endl;
+	exit(1);
+    }
+    if (c.multispin && (c.potts_q > 0 || c.weighted || c.packed_state || c.layout != SHARED_LAYOUT)) {
+	cout << "Error: --multispin requires the plain Ising model, --state=int and --layout=shared." << endl;
+	exit(1);
+    }
+    if (c.multispin && (!c.checkpoint_file.empty() || c.target_ess > 0 || c.tolerance > 0)) {
+	cout << "Error: --multispin does not support checkpoints or early stopping." << endl;
+	exit(1);
+    }
+    if (c.reorder == MORTON_REORDER && c.graph != LATTICE_2D) {
+	cout << "Error: --reorder=morton requires the 2D lattice." << endl;
+	exit(1);
+    }
+    if (c.layout == PADDED_LAYOUT && (c.mode != HOGWILD || c.packed_state)) {
+	cout << "Error: --layout=padded requires --mode=hogwild and --state=int." << endl;
+	exit(1);
+    }
+    if (c.weighted && c.packed_state) {
+	cout << "Error: The weighted model requires --state=int." << endl;
+	exit(1);
+    }
+    if ((c.mode == SWENDSEN_WANG || c.mode == WOLFF) && (c.potts_q > 0 || c.weighted || c.packed_state || c.multispin)) {
+	cout << "Error: Cluster modes require the plain Ising model and --state=int." << endl;
+	exit(1);
+    }
+    if (c.cyclades_pipeline && c.mode != CYCLADES) {
+	cout << "Error: --cyclades-pipeline requires --mode=cyclades." << endl;
+	exit(1);
+    }
+    if (c.mode == CHECKERBOARD && c.graph != LATTICE_2D) {
+	cout << "Error: Checkerboard mode requires the 2D lattice." << endl;
+	exit(1);
+    }
+    return c;
+}
+
+// UpdateState specialized to the 2D lattice: the four neighbors of site
+// (i, j) are read directly from the state, so no adjacency list is
+// needed. Neighbors outside the lattice contribute 0.
+inline void UpdateLatticeState(vector<int> &state, ConditionalTable &table, int length, int i, int j, int sweep, Observables &delta) {
+    int index = i*length+j;
+    int product_with_1 = 0;
+    if (i > 0) product_with_1 += state[index-length];
+    if (i+1 < length) product_with_1 += state[index+length];
+    if (j > 0) product_with_1 += state[index-1];
+    if (j+1 < length) product_with_1 += state[index+1];
+
+    int old_spin = state[index];
+    uint32_t threshold = table.threshold[product_with_1 + table.max_degree];
+    state[index] = RandomBits(config.seed, index, sweep, 0) < threshold ? 1 : -1;
+    delta.Add(old_spin, state[index], product_with_1);
+}
+
+// Updates the sites of lattice row i whose color (i+j) % 2 equals color.
+typedef void (*LatticeRowKernel)(vector<int> &state, ConditionalTable &table, int length, int i, int color, int sweep, Observables &delta);
+
+void UpdateLatticeRowScalar(vector<int> &state, ConditionalTable &table, int length, int i, int color, int sweep, Observables &delta) {
+    for (int j = (i + color) & 1; j < length; j += 2) {
+	UpdateLatticeState(state, table, length, i, j, sweep, delta);
+    }
+}
+
+#ifdef LATTICE_SIMD
+// Vector kernels. Interior blocks of 8 (AVX2) or 16 (AVX-512) columns are
+// updated at once: the up, down, left and right rows are loaded and added,
+// thresholds are gathered from the table, Philox is evaluated lane-wise,
+// and only lanes of the requested color are stored. Blocks start at column
+// 1, so lane l of a block in row i has color (i+1+l) % 2. Checkerboard
+// results match the scalar kernel bit for bit.
+
+__attribute__((target("avx2")))
+static inline void MulHiLoAvx2(__m256i a, __m256i m, __m256i &hi, __m256i &lo) {
+    __m256i even = _mm256_mul_epu32(a, m);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+    lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+// Lane-wise Philox4x32-10, returning the first output word.
+__attribute__((target("avx2")))
+static inline __m256i RandomBitsAvx2(uint64_t seed, __m256i vertex, uint32_t sweep, uint32_t stream) {
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+    __m256i c0 = vertex, c1 = _mm256_set1_epi32(sweep);
+    __m256i c2 = _mm256_set1_epi32(stream), c3 = _mm256_setzero_si256();
+    __m256i m0 = _mm256_set1_epi32(0xD2511F53), m1 = _mm256_set1_epi32(0xCD9E8D57);
+    for (int round = 0; round < 10; round++) {
+	__m256i hi0, lo0, hi1, lo1;
+	MulHiLoAvx2(c0, m0, hi0, lo0);
+	MulHiLoAvx2(c2, m1, hi1, lo1);
+	c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32(k0));
+	c1 = lo1;
+	c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32(k1));
+	c3 = lo0;
+	k0 += 0x9E3779B9;
+	k1 += 0xBB67AE85;
+    }
+    return c0;
+}
+
+__attribute__((target("avx2")))
+void UpdateLatticeRowAvx2(vector<int> &state, ConditionalTable &table, int length, int i, int color, int sweep, Observables &delta) {
+    int *row = &state[i*length];
+    const int *up = i > 0 ? row - length : NULL;
+    const int *down = i+1 < length ? row + length : NULL;
+    const int *threshold = (const int *)&table.threshold[0];
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i offset = _mm256_set1_epi32(table.max_degree);
+    __m256i sign = _mm256_set1_epi32(0x80000000);
+    __m256i lane_color = _mm256_and_si256(_mm256_add_epi32(lane, _mm256_set1_epi32(i+1)), one);
+    __m256i write_mask = _mm256_cmpeq_epi32(lane_color, _mm256_set1_epi32(color));
+
+    if ((i & 1) == color) {
+	UpdateLatticeState(state, table, length, i, 0, sweep, delta);
+    }
+    // Per-lane magnetization and energy changes, reduced after the row.
+    __m256i magnetization = _mm256_setzero_si256();
+    __m256i energy = _mm256_setzero_si256();
+    int j = 1;
+    for (; j + 8 < length; j += 8) {
+	__m256i sum = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(row+j-1)),
+				       _mm256_loadu_si256((const __m256i *)(row+j+1)));
+	if (up) sum = _mm256_add_epi32(sum, _mm256_loadu_si256((const __m256i *)(up+j)));
+	if (down) sum = _mm256_add_epi32(sum, _mm256_loadu_si256((const __m256i *)(down+j)));
+	__m256i limit = _mm256_i32gather_epi32(threshold, _mm256_add_epi32(sum, offset), 4);
+	__m256i vertex = _mm256_add_epi32(_mm256_set1_epi32(i*length+j), lane);
+	__m256i bits = RandomBitsAvx2(config.seed, vertex, sweep, 0);
+	// Unsigned bits < limit, via a signed compare on flipped sign bits.
+	__m256i accept = _mm256_cmpgt_epi32(_mm256_xor_si256(limit, sign), _mm256_xor_si256(bits, sign));
+	__m256i spin = _mm256_sub_epi32(_mm256_and_si256(accept, _mm256_set1_epi32(2)), one);
+	__m256i old_spin = _mm256_loadu_si256((const __m256i *)(row+j));
+	_mm256_maskstore_epi32(row+j, write_mask, spin);
+	__m256i change = _mm256_and_si256(_mm256_sub_epi32(spin, old_spin), write_mask);
+	magnetization = _mm256_add_epi32(magnetization, change);
+	energy = _mm256_sub_epi32(energy, _mm256_mullo_epi32(change, sum));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, magnetization);
+    for (int lane_index = 0; lane_index < 8; lane_index++) delta.magnetization += lanes[lane_index];
+    _mm256_storeu_si256((__m256i *)lanes, energy);
+    for (int lane_index = 0; lane_index < 8; lane_index++) delta.energy += lanes[lane_index];
+    for (; j < length; j++) {
+	if (((i + j) & 1) == color) {
+	    UpdateLatticeState(state, table, length, i, j, sweep, delta);
+	}
+    }
+}
+
+__attribute__((target("avx512f")))
+static inline void MulHiLoAvx512(__m512i a, __m512i m, __m512i &hi, __m512i &lo) {
+    __m512i even = _mm512_mul_epu32(a, m);
+    __m512i odd = _mm512_mul_epu32(_mm512_srli_epi64(a, 32), m);
+    lo = _mm512_mask_blend_epi32(0xAAAA, even, _mm512_slli_epi64(odd, 32));
+    hi = _mm512_mask_blend_epi32(0xAAAA, _mm512_srli_epi64(even, 32), odd);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i RandomBitsAvx512(uint64_t seed, __m512i vertex, uint32_t sweep, uint32_t stream) {
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+    __m512i c0 = vertex, c1 = _mm512_set1_epi32(sweep);
+    __m512i c2 = _mm512_set1_epi32(stream), c3 = _mm512_setzero_si512();
+    __m512i m0 = _mm512_set1_epi32(0xD2511F53), m1 = _mm512_set1_epi32(0xCD9E8D57);
+    for (int round = 0; round < 10; round++) {
+	__m512i hi0, lo0, hi1, lo1;
+	MulHiLoAvx512(c0, m0, hi0, lo0);
+	MulHiLoAvx512(c2, m1, hi1, lo1);
+	c0 = _mm512_xor_si512(_mm512_xor_si512(hi1, c1), _mm512_set1_epi32(k0));
+	c1 = lo1;
+	c2 = _mm512_xor_si512(_mm512_xor_si512(hi0, c3), _mm512_set1_epi32(k1));
+	c3 = lo0;
+	k0 += 0x9E3779B9;
+	k1 += 0xBB67AE85;
+    }
+    return c0;
+}
+
+__attribute__((target("avx512f")))
+void UpdateLatticeRowAvx512(vector<int> &state, ConditionalTable &table, int length, int i, int color, int sweep, Observables &delta) {
+    int *row = &state[i*length];
+    const int *up = i > 0 ? row - length : NULL;
+    const int *down = i+1 < length ? row + length : NULL;
+    const int *threshold = (const int *)&table.threshold[0];
+    __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i one = _mm512_set1_epi32(1);
+    __m512i offset = _mm512_set1_epi32(table.max_degree);
+    __mmask16 write_mask = ((i+1) & 1) == color ? 0x5555 : 0xAAAA;
+
+    if ((i & 1) == color) {
+	UpdateLatticeState(state, table, length, i, 0, sweep, delta);
+    }
+    __m512i magnetization = _mm512_setzero_si512();
+    __m512i energy = _mm512_setzero_si512();
+    int j = 1;
+    for (; j + 16 < length; j += 16) {
+	__m512i sum = _mm512_add_epi32(_mm512_loadu_si512(row+j-1), _mm512_loadu_si512(row+j+1));
+	if (up) sum = _mm512_add_epi32(sum, _mm512_loadu_si512(up+j));
+	if (down) sum = _mm512_add_epi32(sum, _mm512_loadu_si512(down+j));
+	__m512i limit = _mm512_i32gather_epi32(_mm512_add_epi32(sum, offset), threshold, 4);
+	__m512i vertex = _mm512_add_epi32(_mm512_set1_epi32(i*length+j), lane);
+	__m512i bits = RandomBitsAvx512(config.seed, vertex, sweep, 0);
+	__mmask16 accept = _mm512_cmplt_epu32_mask(bits, limit);
+	__m512i spin = _mm512_mask_blend_epi32(accept, _mm512_sub_epi32(_mm512_setzero_si512(), one), one);
+	__m512i old_spin = _mm512_loadu_si512(row+j);
+	_mm512_mask_storeu_epi32(row+j, write_mask, spin);
+	__m512i change = _mm512_maskz_sub_epi32(write_mask, spin, old_spin);
+	magnetization = _mm512_add_epi32(magnetization, change);
+	energy = _mm512_sub_epi32(energy, _mm512_mullo_epi32(change, sum));
+    }
+    delta.magnetization += _mm512_reduce_add_epi32(magnetization);
+    delta.energy += _mm512_reduce_add_epi32(energy);
+    for (; j < length; j++) {
+	if (((i + j) & 1) == color) {
+	    UpdateLatticeState(state, table, length, i, j, sweep, delta);
+	}
+    }
+}
+#endif
+
+// Pick the widest lattice kernel supported by both the CPU and level.
+LatticeRowKernel SelectLatticeRowKernel(SimdLevel level, const char **name) {
+#ifdef LATTICE_SIMD
+    __builtin_cpu_init();
+    if (level >= SIMD_AVX512 && __builtin_cpu_supports("avx512f")) {
+	*name = "avx512";
+	return UpdateLatticeRowAvx512;
+    }
+    if (level >= SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+	*name = "avx2";
+	return UpdateLatticeRowAvx2;
+    }
+#endif
+    *name = "scalar";
+    return UpdateLatticeRowScalar;
+}
+
+// One sweep of the lattice with the stencil kernels and rows split
+// across threads. In checkerboard mode all even sites are updated, then
+// all odd sites, matching PartitionDatapointsForCheckerboard. Otherwise
+// rows are updated Hogwild style in a single pass. Each row is still
+// visited in two halves, even then odd sites, so no kernel ever updates
+// two adjacent sites at once: that would be a synchronous update, which
+// samples the wrong distribution.
+Observables LatticeSweep(vector<int> &state, ConditionalTable &table, LatticeRowKernel kernel, bool checkerboard, int sweep) {
+    int length = (int)sqrt(config.n);
+    Observables total;
+#pragma omp parallel num_threads(config.n_threads)
+    {
+	Observables delta;
+	if (checkerboard) {
+	    for (int color = 0; color < 2; color++) {
+		// The implicit barrier at the end of the loop separates colors.
+#pragma omp for schedule(static)
+		for (int i = 0; i < length; i++) {
+		    kernel(state, table, length, i, color, sweep, delta);
+		}
+	    }
+	}
+	else {
+#pragma omp for schedule(static)
+	    for (int i = 0; i < length; i++) {
+		kernel(state, table, length, i, 0, sweep, delta);
+		kernel(state, table, length, i, 1, sweep, delta);
+	    }
+	}
+#pragma omp critical
+	{
+	    total.magnetization += delta.magnetization;
+	    total.energy += delta.energy;
+	}
+    }
+    return total;
+}
+
+// Same update as UpdateState on a packed state. The up neighbors are
+// counted by extracting their bits, giving sum = 2*n_up - degree.
+// Words are accessed with relaxed atomics. If shared_words is false the
+// caller guarantees each word is written by a single thread (e.g. Hogwild
+// ranges aligned to 64), so a plain store replaces the locked RMW.
+template <bool shared_words>
+void UpdatePackedState(Graph &g, PackedState &state, ConditionalTable &table, int index, int sweep, Observables &delta) {
+    uint64_t *words = &state.words[0];
+    const int *neighbors = &g.neighbors[0];
+    int n_up = 0;
+    for (int i = g.offsets[index]; i < g.offsets[index+1]; i++) {
+	int neighbor = neighbors[i];
+	uint64_t word = __atomic_load_n(&words[neighbor >> 6], __ATOMIC_RELAXED);
+	n_up += (word >> (neighbor & 63)) & 1;
+    }
+    int product_with_1 = 2*n_up - Degree(g, index);
+
+    uint32_t threshold = table.threshold[product_with_1 + table.max_degree];
+    bool up = RandomBits(config.seed, index, sweep, 0) < threshold;
+    uint64_t mask = 1ULL << (index & 63);
+    uint64_t *word = &words[index >> 6];
+    uint64_t old_word;
+    if (shared_words) {
+	if (up) old_word = __atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+	else old_word = __atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED);
+    }
+    else {
+	uint64_t bit = up ? mask : 0;
+	old_word = __atomic_load_n(word, __ATOMIC_RELAXED);
+	__atomic_store_n(word, (old_word & ~mask) | bit, __ATOMIC_RELAXED);
+    }
+    delta.Add((old_word & mask) ? 1 : -1, up ? 1 : -1, product_with_1);
+}
+
+// Multi-spin coded update of all 64 replicas of vertex index: bit r of
+// replicas[v] is the spin of v in replica r, set for +1. Each replica
+// makes the same decision as UpdateState, u_r < threshold[sum_r], with
+// its own uniform u_r, but every step is bitwise over the 64 replicas:
+// - The up neighbors are summed into bit-sliced counters (planes).
+// - Replicas are grouped by count, at most 64 groups.
+// - u_r is compared with its group's threshold bit-serially from the most
+//   significant bit. Bit k of all 64 u_r is one random word, and the loop
+//   stops once no replica's u_r matches its threshold so far, typically
+//   after about 8 bits, so 4 Philox calls serve 64 updates.
+void UpdateMultiSpin(Graph &g, vector<uint64_t> &replicas, ConditionalTable &table, int index, int sweep) {
+    uint64_t planes[32] = {0};
+    int n_planes = 0;
+    const int *neighbors = &g.neighbors[0];
+    for (int i = g.offsets[index]; i < g.offsets[index+1]; i++) {
+	uint64_t carry = replicas[neighbors[i]];
+	for (int p = 0; carry; p++) {
+	    uint64_t next = planes[p] & carry;
+	    planes[p] ^= carry;
+	    carry = next;
+	    n_planes = max(n_planes, p+1);
+	}
+    }
+
+    int degree = Degree(g, index), n_groups = 0;
+    uint64_t group_mask[64], covered = 0;
+    uint32_t group_threshold[64];
+    for (int count = 0; count <= degree && covered != ~0ULL; count++) {
+	uint64_t mask = ~0ULL;
+	for (int p = 0; p < n_planes; p++) mask &= ((count >> p) & 1) ? planes[p] : ~planes[p];
+	if ((count >> n_planes) != 0 || mask == 0) continue;
+	group_mask[n_groups] = mask;
+	group_threshold[n_groups++] = table.threshold[2*count - degree + table.max_degree];
+	covered |= mask;
+    }
+
+    uint32_t key[2] = {(uint32_t)config.seed, (uint32_t)(config.seed >> 32)};
+    uint64_t less = 0, undecided = ~0ULL;
+    for (int call = 0; call < 16 && undecided; call++) {
+	uint32_t counter[4] = {(uint32_t)index, (uint32_t)sweep, 7, (uint32_t)call};
+	Philox4x32(key, counter);
+	uint64_t random[2] = {((uint64_t)counter[1] << 32) | counter[0], ((uint64_t)counter[3] << 32) | counter[2]};
+	for (int b = 0; b < 2; b++) {
+	    int bit = 31 - 2*call - b;
+	    uint64_t threshold = 0;
+	    for (int i = 0; i < n_groups; i++) {
+		if ((group_threshold[i] >> bit) & 1) threshold |= group_mask[i];
+	    }
+	    less |= undecided & ~random[b] & threshold;
+	    undecided &= ~(random[b] ^ threshold);
+	}
+    }
+    replicas[index] = less;
+}
+
+// Per-replica counts of set bits over many words, as 64 bit-sliced binary
+// counters. Add is a ripple-carry add, O(1) amortized.
+struct ReplicaCounter {
+    uint64_t planes[64];
+
+    ReplicaCounter() { memset(planes, 0, sizeof(planes)); }
+
+    void Add(uint64_t word) {
+	for (int p = 0; word; p++) {
+	    uint64_t carry = planes[p] & word;
+	    planes[p] ^= word;
+	    word = carry;
+	}
+    }
+
+    long long Count(int replica) const {
+	long long count = 0;
+	for (int p = 0; p < 64; p++) count += (long long)((planes[p] >> replica) & 1) << p;
+	return count;
+    }
+};
+
+// Cluster updates (Swendsen and Wang, PRL 58, 1987; Wolff, PRL 62, 1989).
+// Each edge between equal spins becomes a bond with probability
+// 1 - exp(-2*beta), and bonded clusters are flipped as a whole. This
+// satisfies detailed balance like a single-spin update, but moves whole
+// correlated domains, so near the critical point the autocorrelation time
+// grows far more slowly with the lattice size.
+
+// One Swendsen-Wang sweep, which flips every cluster with probability 1/2.
+// Bonds are drawn in parallel and unioned with ConcurrentUnion. Vertex i
+// draws the bonds to its larger neighbors, four per Philox call from
+// stream 10. Each cluster's root is its smallest vertex, so its flip, bit
+// root of the words drawn from stream 11, does not depend on the thread
+// count or the union order. parent and flips are scratch space. Returns
+// the new observables.
+Observables SwendsenWangSweep(Graph &g, vector<int> &state, vector<int> &parent, vector<uint32_t> &flips,
+			      uint32_t bond_threshold, int sweep) {
+    int n = config.n, n_blocks = (n + 127) / 128;
+    parent.resize(n);
+    flips.resize(4 * n_blocks);
+    uint32_t key[2] = {(uint32_t)config.seed, (uint32_t)(config.seed >> 32)};
+#pragma omp parallel num_threads(config.n_threads)
+    {
+#pragma omp for schedule(static)
+	for (int i = 0; i < n; i++) parent[i] = i;
+
+#pragma omp for schedule(dynamic, 1024)
+	for (int i = 0; i < n; i++) {
+	    uint32_t counter[4];
+	    for (int j = g.offsets[i], k = 0; j < g.offsets[i+1]; j++) {
+		int neighbor = g.neighbors[j];
+		if (neighbor < i || state[neighbor] != state[i]) continue;
+		if (k % 4 == 0) {
+		    counter[0] = i;
+		    counter[1] = sweep;
+		    counter[2] = 10;
+		    counter[3] = k / 4;
+		    Philox4x32(key, counter);
+		}
+		if (counter[k++ % 4] < bond_threshold) ConcurrentUnion(parent, i, neighbor);
+	    }
+	}
+
+#pragma omp for schedule(static)
+	for (int block = 0; block < n_blocks; block++) {
+	    uint32_t counter[4] = {(uint32_t)block, (uint32_t)sweep, 11, 0};
+	    Philox4x32(key, counter);
+	    memcpy(&flips[4 * block], counter, sizeof(counter));
+	}
+
+#pragma omp for schedule(static)
+	for (int i = 0; i < n; i++) {
+	    int root = ConcurrentFindRoot(parent, i);
+	    if ((flips[root / 32] >> (root % 32)) & 1) state[i] = -state[i];
+	}
+    }
+
+    long long magnetization = 0;
+    double energy = 0;
+#pragma omp parallel for num_threads(config.n_threads) schedule(static) reduction(+:magnetization,energy)
+    for (int i = 0; i < n; i++) {
+	int sum = 0;
+	for (int j = g.offsets[i]; j < g.offsets[i+1]; j++) {
+	    if (g.neighbors[j] > i) sum += state[g.neighbors[j]];
+	}
+	magnetization += state[i];
+	energy -= state[i] * sum;
+    }
+    Observables result;
+    result.magnetization = magnetization;
+    result.energy = energy;
+    return result;
+}
+
+// One Wolff sweep: n_clusters single clusters are grown from random seeds
+// and flipped. Growth is sequential. The i-th random number of the sweep is
+// RandomBits(seed, i, sweep, stream). in_cluster and stack are scratch
+// space. Returns the number of clusters.
+//
+// The count must not depend on the chain: stopping once n spins have
+// flipped would sample right after large clusters more often, which
+// biases the energy. n_clusters <= 0 does exactly that, for calibration.
+int WolffSweep(Graph &g, vector<int> &state, vector<char> &in_cluster, vector<int> &stack,
+	       uint32_t bond_threshold, int n_clusters, int sweep, int stream, Observables &delta) {
+    int n = config.n;
+    in_cluster.assign(n, 0);
+    uint32_t draw = 0;
+    int cluster = 0;
+    for (long long flipped = 0; n_clusters > 0 ? cluster < n_clusters : flipped < n; cluster++) {
+	int seed_vertex = RandomBelow(RandomBits(config.seed, draw++, sweep, stream), n);
+	int spin = state[seed_vertex];
+	stack.clear();
+	stack.push_back(seed_vertex);
+	in_cluster[seed_vertex] = 1;
+	for (size_t top = 0; top < stack.size(); top++) {
+	    int vertex = stack[top];
+	    for (int j = g.offsets[vertex]; j < g.offsets[vertex+1]; j++) {
+		int neighbor = g.neighbors[j];
+		if (in_cluster[neighbor] || state[neighbor] != spin) continue;
+		if (RandomBits(config.seed, draw++, sweep, stream) < bond_threshold) {
+		    in_cluster[neighbor] = 1;
+		    stack.push_back(neighbor);
+		}
+	    }
+	}
+
+	// Only edges leaving the cluster change energy.
+	for (size_t i = 0; i < stack.size(); i++) {
+	    int vertex = stack[i], outside = 0;
+	    for (int j = g.offsets[vertex]; j < g.offsets[vertex+1]; j++) {
+		if (!in_cluster[g.neighbors[j]]) outside += state[g.neighbors[j]];
+	    }
+	    delta.Add(spin, -spin, outside);
+	}
+	for (size_t i = 0; i < stack.size(); i++) {
+	    state[stack[i]] = -spin;
+	    in_cluster[stack[i]] = 0;
+	}
+	flipped += stack.size();
+    }
+    return cluster;
+}
+
+// Run one pass over the access pattern, calling update(index, sweep, delta)
+// for every scheduled vertex with a per-thread delta. Returns the summed
+// change in observables.
+template <typename UpdateFunction>
+Observables Sweep(AccessPattern &access_pattern, int n_batches, int sweep, UpdateFunction update) {
+    Observables total;
+#pragma omp parallel num_threads(config.n_threads)
+    {
+	int thread = omp_get_thread_num();
+	Observables delta;
+	for (int batch = 0; batch < n_batches; batch++) {
+	    for (int to_update = 0; to_update < access_pattern[thread][batch].size(); to_update++) {
+		update(access_pattern[thread][batch][to_update], sweep, delta);
+	    }
+	    // Cyclades batches are only conflict free internally, so
+	    // all threads must finish a batch before the next starts.
+#pragma omp barrier
+	}
+#pragma omp critical
+	{
+	    total.magnetization += delta.magnetization;
+	    total.energy += delta.energy;
+	}
+    }
+    return total;
+}
+
+// Sweep for --cyclades-pipeline: config.n_threads workers run batch b
+// while one more thread plans batch b+1 into the other buffer, with a
+// barrier between batches. During the last batch it plans batch 0 of the
+// next sweep, which is used if that sweep is sweep+1 with the same thread
+// count. If the team is smaller than asked for, the remaining threads both
+// plan and update.
+template <typename UpdateFunction>
+Observables PipelinedSweep(Graph &g, CycladesPipeline &p, int sweep, UpdateFunction update) {
+    int n_workers = config.n_threads, batch_size = CycladesBatchSize();
+    int n_batches = (config.n + batch_size - 1) / batch_size;
+    p.order.resize(config.n);
+    p.position.resize(config.n, -1);
+    p.parent.resize(batch_size);
+    p.root.resize(batch_size);
+    p.component_thread.resize(batch_size);
+    p.load.resize(n_workers);
+    for (int buffer = 0; buffer < 2; buffer++) p.buffers[buffer].resize(n_workers);
+
+    double start_time = omp_get_wtime();
+    int current = p.planned_buffer;
+    if (current < 0 || p.planned_sweep != sweep || p.planned_threads != n_workers) {
+	current = 0;
+	PlanCycladesBatch(g, p, sweep, 0, p.buffers[current]);
+    }
+
+    Observables total;
+#pragma omp parallel num_threads(n_workers + 1)
+    {
+	int thread = omp_get_thread_num(), team = omp_get_num_threads();
+	bool planner = thread == team - 1, worker = team == 1 || !planner;
+	int n_team_workers = max(1, team - 1);
+	int buffer = current;
+	double working = 0;
+	Observables delta;
+	for (int batch = 0; batch < n_batches; batch++) {
+	    if (planner) {
+		if (batch + 1 < n_batches) PlanCycladesBatch(g, p, sweep, batch + 1, p.buffers[buffer ^ 1]);
+		else PlanCycladesBatch(g, p, sweep + 1, 0, p.buffers[buffer ^ 1]);
+	    }
+	    if (worker) {
+		double work_start = omp_get_wtime();
+		for (int w = thread; w < n_workers; w += n_team_workers) {
+		    vector<int> &to_update = p.buffers[buffer][w];
+		    for (int i = 0; i < to_update.size(); i++) update(to_update[i], sweep, delta);
+		}
+		working += omp_get_wtime() - work_start;
+	    }
+	    buffer ^= 1;
+#pragma omp barrier
+	}
+#pragma omp critical
+	{
+	    total.magnetization += delta.magnetization;
+	    total.energy += delta.energy;
+	    p.working += working;
+	}
+    }
+    p.planned_buffer = current ^ (n_batches % 2);
+    p.planned_sweep = sweep + 1;
+    p.planned_threads = n_workers;
+    p.elapsed += omp_get_wtime() - start_time;
+    return total;
+}
+
+// Raw little endian serialization helpers for checkpoints.
+template <typename T>
+void Put(vector<char> &out, const T &value) {
+    out.insert(out.end(), (const char *)&value, (const char *)&value + sizeof(T));
+}
+
+template <typename T>
+void PutArray(vector<char> &out, const vector<T> &values) {
+    Put(out, (uint64_t)values.size());
+    out.insert(out.end(), (const char *)values.data(), (const char *)(values.data() + values.size()));
+}
+
+template <typename T>
+bool Get(const char *&in, const char *end, T &value) {
+    if (end - in < (long)sizeof(T)) return false;
+    memcpy(&value, in, sizeof(T));
+    in += sizeof(T);
+    return true;
+}
+
+template <typename T>
+bool GetArray(const char *&in, const char *end, vector<T> &values) {
+    uint64_t size;
+    if (!Get(in, end, size) || size > (uint64_t)(end - in) / sizeof(T)) return false;
+    values.resize(size);
+    memcpy(values.data(), in, size * sizeof(T));
+    in += size * sizeof(T);
+    return true;
+}
+
+// Online autocorrelation of a scalar time series. Keeps the first and
+// last max_lag values and running sums of x_t * x_{t-k} for k <= max_lag,
+// so Add is O(max_lag) and the integrated autocorrelation time can be
+// read at any point without storing the series. Values are shifted by
+// the first sample to limit cancellation in the moment sums.
+class AutocorrelationEstimator {
+public:
+    AutocorrelationEstimator(int max_lag)
+	: max_lag_(max_lag), n_(0), shift_(0), sum_(0), sum_squares_(0),
+	  history_(max_lag+1), lag_products_(max_lag+1) {}
+
+    void Add(double x) {
+	if (n_ == 0) shift_ = x;
+	x -= shift_;
+	if (n_ < max_lag_) head_.push_back(x);
+	history_[n_ % history_.size()] = x;
+	int n_lags = min<long>(max_lag_, n_);
+	for (int lag = 0; lag <= n_lags; lag++) {
+	    lag_products_[lag] += x * history_[(n_ - lag) % history_.size()];
+	}
+	sum_ += x;
+	sum_squares_ += x * x;
+	n_++;
+    }
+
+    long Count() const { return n_; }
+    double Mean() const { return n_ > 0 ? shift_ + sum_ / n_ : 0; }
+
+    double Variance() const {
+	if (n_ < 2) return 0;
+	double mean = sum_ / n_;
+	return max(0.0, sum_squares_ / n_ - mean * mean);
+    }
+
+    // Integrated autocorrelation time tau = 1 + 2 * sum_k rho_k, summed up
+    // to Sokal's automatic window: the smallest W with W >= 5 * tau(W).
+    double Tau() const {
+	double variance = Variance();
+	if (variance <= 0) return 1;
+	double mean = sum_ / n_;
+	double tau = 1;
+	double head_sum = 0, tail_sum = 0;
+	int n_lags = min<long>(max_lag_, n_ - 1);
+	for (int lag = 1; lag <= n_lags; lag++) {
+	    // sum_{t>=lag} (x_t - mean) * (x_{t-lag} - mean), expanded with the
+	    // sums of the first and last lag values that each factor omits.
+	    head_sum += head_[lag-1];
+	    tail_sum += history_[(n_ - lag) % history_.size()];
+	    double covariance = lag_products_[lag] - mean * (sum_ - head_sum) -
+		mean * (sum_ - tail_sum) + (n_ - lag) * mean * mean;
+	    tau += 2 * covariance / (n_ - lag) / variance;
+	    if (lag >= 5 * tau) break;
+	}
+	return max(1.0, tau);
+    }
+
+    double EffectiveSampleSize() const { return n_ / Tau(); }
+
+    double StandardError() const {
+	return n_ > 0 ? sqrt(Variance() * Tau() / n_) : 0;
+    }
+
+    void Save(vector<char> &out) const {
+	Put(out, n_);
+	Put(out, shift_);
+	Put(out, sum_);
+	Put(out, sum_squares_);
+	PutArray(out, head_);
+	PutArray(out, history_);
+	PutArray(out, lag_products_);
+    }
+
+    bool Load(const char *&in, const char *end) {
+	return Get(in, end, n_) && Get(in, end, shift_) && Get(in, end, sum_) && Get(in, end, sum_squares_) &&
+	    GetArray(in, end, head_) && GetArray(in, end, history_) && GetArray(in, end, lag_products_) &&
+	    head_.size() <= max_lag_ && history_.size() == max_lag_ + 1 && lag_products_.size() == max_lag_ + 1;
+    }
+
+private:
+    int max_lag_;
+    long n_;
+    double shift_;
+    double sum_;
+    double sum_squares_;
+    vector<double> head_;           // First max_lag values
+    vector<double> history_;        // Last max_lag+1 values, circular
+    vector<double> lag_products_;
+};
+
+// Everything a sweep of the chain needs.
+struct Sampler {
+    Graph g;
+    WeightedGraph weighted;         // Only built when config.weighted is set
+    vector<int> state;              // Unused when config.packed_state is set
+    PackedState packed;
+    vector<uint64_t> replicas;      // Only used when config.multispin is set
+
+    // Access pattern partitions.
+    // Of form [thread][batch][state to update].
+    // Note that for hogwild, there will only be one batch
+    AccessPattern access_pattern;
+    int n_batches;
+    CycladesTiming cyclades_timing;         // Only set in Cyclades mode
+    CycladesPipeline pipeline;              // Only used with --cyclades-pipeline
+
+    double beta;
+    ConditionalTable table;
+    PottsModel potts;               // Only built when config.potts_q > 0
+    LatticeRowKernel lattice_kernel;
+    const char *lattice_kernel_name;
+
+    // Padded Hogwild layout: state holds the n spins, then each thread's
+    // ghost copies of its remote neighbors. The layout graphs point
+    // remote neighbors at the ghosts.
+    Graph layout_graph;
+    WeightedGraph layout_weighted;
+    vector<vector<pair<int, int> > > ghosts;   // [thread] (ghost slot, vertex)
+    // The ghosts of vertices updated in each batch, as [thread]
+    // [ghost_offsets[thread][batch]..ghost_offsets[thread][batch+1]).
+    vector<vector<pair<int, int> > > batch_ghosts;
+    vector<vector<int> > ghost_offsets;
+
+    // With --reorder, vertex v of the generated graph is vertex relabel[v]
+    // of g, state and the kernels. Empty when not reordered.
+    vector<int> relabel;
+
+    // Scratch space of the cluster modes.
+    vector<int> cluster_parent;
+    vector<uint32_t> cluster_flips;
+    vector<int> cluster_stack;
+    vector<char> in_cluster;
+    int wolff_clusters;             // Clusters per Wolff sweep
+
+    // Kept current by RunSweep from the kernels' per-update deltas.
+    // Exact for conflict-free schedules. Hogwild races can make it drift.
+    Observables observables;
+};
+
+// Lattice runs with an int state use the stencil row kernels instead of
+// the access pattern.
+bool UsesLatticeKernel() {
+    return !config.packed_state && !config.weighted && config.potts_q == 0 && config.graph == LATTICE_2D &&
+	(config.mode == HOGWILD || config.mode == CHECKERBOARD) && config.layout == SHARED_LAYOUT &&
+	config.reorder == NO_REORDER && !config.multispin;
+}
+
+// Relabel the graph (and a weighted graph loaded from a file) in the order
+// chosen by config.reorder, so neighbors sit close together in the state.
+// States passed in and out of the run are translated with
+// ToSamplerOrder and FromSamplerOrder.
+void ReorderSampler(Sampler &s) {
+    vector<int> order;
+    if (config.reorder == MORTON_REORDER) order = MortonOrder((int)sqrt(config.n));
+    else order = BreadthFirstOrder(s.g, config.reorder == RCM_REORDER);
+    s.relabel.resize(order.size());
+    for (int u = 0; u < order.size(); u++) s.relabel[order[u]] = u;
+
+    double before = MeanNeighborDistance(s.g);
+    vector<int> &relabel = s.relabel;
+    Graph g;
+    RelabelAdjacency(s.g.offsets, s.g.neighbors, order, g.offsets, g.neighbors,
+		     [&](int w) { return relabel[w]; });
+    s.g = g;
+    if (s.weighted.offsets.size() > 0) {
+	WeightedGraph w;
+	RelabelAdjacency(s.weighted.offsets, s.weighted.edges, order, w.offsets, w.edges, [&](WeightedEdge e) {
+	    e.neighbor = relabel[e.neighbor];
+	    return e;
+	});
+	w.field.resize(order.size());
+	for (int u = 0; u < order.size(); u++) w.field[u] = s.weighted.field[order[u]];
+	s.weighted = w;
+    }
+    printf("Mean neighbor distance: %.1f before reordering, %.1f after\n", before, MeanNeighborDistance(s.g));
+}
+
+vector<int> ToSamplerOrder(Sampler &s, const vector<int> &state) {
+    if (s.relabel.empty()) return state;
+    vector<int> result(state.size());
+    for (int v = 0; v < state.size(); v++) result[s.relabel[v]] = state[v];
+    return result;
+}
+
+vector<int> FromSamplerOrder(Sampler &s, const vector<int> &state) {
+    if (s.relabel.empty()) return state;
+    vector<int> result(state.size());
+    for (int v = 0; v < state.size(); v++) result[v] = state[s.relabel[v]];
+    return result;
+}
+
+// Copy every thread's ghosts from the spins they shadow.
+void RefreshGhosts(Sampler &s) {
+#pragma omp parallel num_threads(config.n_threads)
+    {
+	vector<pair<int, int> > &ghosts = s.ghosts[omp_get_thread_num()];
+	for (int i = 0; i < ghosts.size(); i++) {
+	    s.state[ghosts[i].first] = s.state[ghosts[i].second];
+	}
+    }
+}
+
+// Padded Hogwild layout. Thread boundaries are aligned to cache lines of
+// the state's actual address, so no two threads write the same line. Reads
+// of neighbors owned by other threads go to per-thread ghost copies after
+// the n spins, each thread's ghosts in their own lines. To keep the ghosts
+// exact, vertices with a remote neighbor are colored greedily so that no
+// edge between two threads joins vertices of the same color, and batch c
+// updates color c (interior vertices go with color 0). No vertex then
+// reads a remote spin that changes during its batch, and after the
+// barrier each thread refreshes its ghosts of the batch's vertices, once
+// per sweep. The sweep is an exact sequential scan, like checkerboard.
+// Spins keep their indices, so the random numbers and single-threaded
+// results are the same as with the shared layout.
+void BuildPaddedLayout(Sampler &s) {
+    const int line = 64 / sizeof(int);
+    int n = config.n, n_threads = config.n_threads;
+    Graph &g = s.g;
+    // Enough room for the ghosts to move with the boundaries if the
+    // state has to be reallocated.
+    size_t slack = 2 * (size_t)n_threads * line * (MaxDegree(g) + 1);
+    if (s.state.size() < n) s.state.resize(n);
+    vector<int> start(n_threads+1), ghost_thread(n), ghost_slot(n);
+    while (true) {
+	long skew = (uintptr_t)s.state.data() / sizeof(int) % line;
+	auto align = [&](long i) { return (i + skew + line - 1) / line * line - skew; };
+	for (int thread = 0; thread <= n_threads; thread++) {
+	    start[thread] = thread == 0 ? 0 : thread == n_threads ? n : min((long)n, align((long)n * thread / n_threads));
+	}
+	fill(ghost_thread.begin(), ghost_thread.end(), -1);
+	s.ghosts.assign(n_threads, vector<pair<int, int> >());
+	long position = align(n);
+	for (int thread = 0; thread < n_threads; thread++) {
+	    position = align(position);
+	    for (int v = start[thread]; v < start[thread+1]; v++) {
+		for (int j = g.offsets[v]; j < g.offsets[v+1]; j++) {
+		    int w = g.neighbors[j];
+		    if ((w >= start[thread] && w < start[thread+1]) || ghost_thread[w] == thread) continue;
+		    ghost_thread[w] = thread;
+		    s.ghosts[thread].push_back(make_pair((int)position++, w));
+		}
+	    }
+	}
+	size_t total = align(position);
+	if (total <= s.state.capacity()) {
+	    s.state.resize(total);
+	    break;
+	}
+	s.state.reserve(total + slack);
+    }
+
+    // Rows of the layout graph past n are empty.
+    size_t total = s.state.size(), n_entries = g.neighbors.size();
+    s.layout_graph.offsets.assign(total+1, n_entries);
+    copy(g.offsets.begin(), g.offsets.end(), s.layout_graph.offsets.begin());
+    s.layout_graph.neighbors.resize(n_entries);
+    for (int thread = 0; thread < n_threads; thread++) {
+	for (int i = 0; i < s.ghosts[thread].size(); i++) ghost_slot[s.ghosts[thread][i].second] = s.ghosts[thread][i].first;
+	for (int v = start[thread]; v < start[thread+1]; v++) {
+	    for (int j = g.offsets[v]; j < g.offsets[v+1]; j++) {
+		int w = g.neighbors[j];
+		bool local = w >= start[thread] && w < start[thread+1];
+		s.layout_graph.neighbors[j] = local ? w : ghost_slot[w];
+	    }
+	}
+    }
+    if (config.weighted) {
+	WeightedGraph &w = s.weighted, &layout = s.layout_weighted;
+	layout.offsets = s.layout_graph.offsets;
+	layout.edges.resize(n_entries);
+	for (size_t j = 0; j < n_entries; j++) {
+	    layout.edges[j].neighbor = s.layout_graph.neighbors[j];
+	    layout.edges[j].coupling = w.edges[j].coupling;
+	}
+	layout.field.assign(total, 0);
+	copy(w.field.begin(), w.field.end(), layout.field.begin());
+    }
+
+    // Greedy coloring over the edges between threads, in index order.
+    vector<int> color(n, -1);
+    vector<char> used(MaxDegree(g) + 2);
+    int n_colors = 1;
+    for (int v = 0; v < n; v++) {
+	fill(used.begin(), used.end(), 0);
+	bool boundary = false;
+	for (int j = g.offsets[v]; j < g.offsets[v+1]; j++) {
+	    if (s.layout_graph.neighbors[j] < n) continue;
+	    boundary = true;
+	    int w = g.neighbors[j];
+	    if (color[w] >= 0) used[color[w]] = 1;
+	}
+	color[v] = 0;
+	while (boundary && used[color[v]]) color[v]++;
+	n_colors = max(n_colors, color[v] + 1);
+    }
+
+    s.access_pattern.assign(n_threads, vector<vector<int> >(n_colors));
+    for (int thread = 0; thread < n_threads; thread++) {
+	for (int v = start[thread]; v < start[thread+1]; v++) s.access_pattern[thread][color[v]].push_back(v);
+    }
+    s.n_batches = n_colors;
+    s.batch_ghosts.assign(n_threads, vector<pair<int, int> >());
+    s.ghost_offsets.assign(n_threads, vector<int>(1, 0));
+    for (int thread = 0; thread < n_threads; thread++) {
+	vector<pair<int, int> > &ghosts = s.batch_ghosts[thread];
+	for (int c = 0; c < n_colors; c++) {
+	    for (int i = 0; i < s.ghosts[thread].size(); i++) {
+		if (color[s.ghosts[thread][i].second] == c) ghosts.push_back(s.ghosts[thread][i]);
+	    }
+	    s.ghost_offsets[thread].push_back(ghosts.size());
+	}
+    }
+    RefreshGhosts(s);
+}
+
+
+
+// Build the access pattern for the current mode and thread count.
+void PartitionSampler(Sampler &s) {
+    if (config.layout == PADDED_LAYOUT) {
+	BuildPaddedLayout(s);
+    }
+    else if (config.mode == HOGWILD || config.mode == SWENDSEN_WANG || config.mode == WOLFF) {
+	// The cluster modes only use this for NUMA placement.
+	// Aligned ranges give each thread exclusive packed words.
+	s.n_batches = PartitionDatapointsForHogwild(s.g, s.state, s.access_pattern, config.packed_state ? 64 : 1);
+    }
+    else if (config.mode == CYCLADES && config.cyclades_pipeline) {
+	// PipelinedSweep plans its own batches every sweep.
+	s.access_pattern.clear();
+	s.n_batches = 0;
+    }
+    else if (config.mode == CYCLADES) {
+	s.n_batches = PartitionDatapointsForCyclades(s.g, s.state, s.access_pattern, s.cyclades_timing);
+    }
+    else if (config.mode == CHECKERBOARD) {
+	s.n_batches = PartitionDatapointsForCheckerboard(s.g, s.state, s.access_pattern);
+	// The colors are defined on lattice coordinates.
+	for (int thread = 0; thread < s.access_pattern.size() && !s.relabel.empty(); thread++) {
+	    for (int color = 0; color < s.n_batches; color++) {
+		vector<int> &batch = s.access_pattern[thread][color];
+		for (int i = 0; i < batch.size(); i++) batch[i] = s.relabel[batch[i]];
+	    }
+	}
+    }
+}
+
+// With --multispin, the state of replica 0.
+vector<int> GetSamplerState(Sampler &s) {
+    if (config.packed_state) return UnpackState(s.packed);
+    if (config.multispin) {
+	vector<int> state(config.n);
+	for (int i = 0; i < config.n; i++) state[i] = (s.replicas[i] & 1) ? 1 : -1;
+	return state;
+    }
+    return vector<int>(s.state.begin(), s.state.begin() + config.n);
+}
+
+// Exact observables of the current state in O(N + E).
+Observables ComputeObservables(Sampler &s) {
+    vector<int> state = GetSamplerState(s);
+    Observables result;
+    for (int i = 0; i < state.size(); i++) {
+	if (config.potts_q > 0) {
+	    PottsModel &model = s.potts;
+	    result.magnetization += state[i] == 0;
+	    for (int j = s.g.offsets[i]; j < s.g.offsets[i+1]; j++) {
+		int neighbor = s.g.neighbors[j];
+		if (neighbor > i) result.energy -= model.interaction[state[neighbor] * model.q + state[i]];
+	    }
+	    continue;
+	}
+	result.magnetization += state[i];
+	if (config.weighted) {
+	    WeightedGraph &w = s.weighted;
+	    result.energy -= w.field[i] * state[i];
+	    for (int j = w.offsets[i]; j < w.offsets[i+1]; j++) {
+		// Each edge is seen from both ends.
+		int neighbor = w.edges[j].neighbor;
+		if (neighbor > i) result.energy -= w.edges[j].coupling * state[i] * state[neighbor];
+	    }
+	    continue;
+	}
+	for (int j = s.g.offsets[i]; j < s.g.offsets[i+1]; j++) {
+	    // Each edge is seen from both ends.
+	    if (s.g.neighbors[j] > i) result.energy -= state[i] * state[s.g.neighbors[j]];
+	}
+    }
+    return result;
+}
+
+// With --multispin, state goes to replica 0 and the other replicas start
+// from independent random states.
+void SetSamplerState(Sampler &s, const vector<int> &state) {
+    // Copy into the existing buffers, which keeps their NUMA placement.
+    if (config.multispin) {
+	s.replicas.resize(state.size());
+	for (int i = 0; i < state.size(); i++) {
+	    uint32_t key[2] = {(uint32_t)config.seed, (uint32_t)(config.seed >> 32)};
+	    uint32_t counter[4] = {(uint32_t)i, 0, 8, 0};
+	    Philox4x32(key, counter);
+	    uint64_t random = ((uint64_t)counter[1] << 32) | counter[0];
+	    s.replicas[i] = (random & ~1ULL) | (state[i] == 1);
+	}
+    }
+    else if (config.packed_state) {
+	PackedState packed = PackState(state);
+	if (s.packed.words.size() == packed.words.size()) {
+	    copy(packed.words.begin(), packed.words.end(), s.packed.words.begin());
+	}
+	else {
+	    s.packed = packed;
+	}
+    }
+    else if (config.layout == PADDED_LAYOUT && s.state.size() > state.size()) {
+	// Keep the padded buffer, whose address the layout is aligned to.
+	copy(state.begin(), state.end(), s.state.begin());
+	RefreshGhosts(s);
+    }
+    else {
+	s.state = state;
+    }
+    s.observables = ComputeObservables(s);
+}
+
+// Pin OpenMP thread t to the t-th CPU this process may run on. With
+// --cyclades-pipeline the team has one more thread, the planner of
+// PipelinedSweep, which would otherwise keep the CPU of the thread that
+// started it.
+void PinThreads() {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+    }
+    if (cpus.empty()) return;
+#pragma omp parallel num_threads(config.n_threads + (config.cyclades_pipeline ? 1 : 0))
+    {
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &mask);
+	sched_setaffinity(0, sizeof(mask), &mask);
+    }
+}
+
+// Move the whole pages of data[0..n) to the NUMA nodes of the threads that
+// use them. Under Linux's first-touch policy a page lives on the node of
+// the thread that first writes it, so the pages are copied aside, dropped
+// with MADV_DONTNEED and written back by the thread that owns the element
+// in the middle of each page. This goes chunk_pages at a time through one
+// small buffer, so even the largest arrays need little extra memory.
+// Partial pages at either end stay put.
+template <typename T, typename Owner>
+void FirstTouch(T *data, size_t n, Owner owner) {
+#ifdef MADV_DONTNEED
+    const size_t chunk_pages = 256;
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t)data + page - 1) / page * page;
+    uintptr_t end = (uintptr_t)(data + n) / page * page;
+    if (end <= begin) return;
+    size_t n_pages = (end - begin) / page;
+    vector<char> saved(min(n_pages, chunk_pages) * page);
+    for (size_t first = 0; first < n_pages; first += chunk_pages) {
+	size_t count = min(chunk_pages, n_pages - first);
+	char *chunk = (char *)begin + first * page;
+	memcpy(saved.data(), chunk, count * page);
+	if (madvise(chunk, count * page, MADV_DONTNEED) != 0) {
+	    // Nothing was dropped, so the data is still in place.
+	    return;
+	}
+#pragma omp parallel num_threads(config.n_threads)
+	{
+	    int thread = omp_get_thread_num();
+	    for (size_t p = 0; p < count; p++) {
+		size_t middle = (chunk + p * page + page / 2 - (char *)data) / sizeof(T);
+		if (owner(min(middle, n-1)) == thread) {
+		    memcpy(chunk + p * page, &saved[p * page], page);
+		}
+	    }
+	}
+    }
+#endif
+}
+
+// Pin the threads, then place the state and every owned graph array next
+// to the thread that updates the vertices it belongs to, as given by the
+// access pattern. Hogwild and checkerboard threads own contiguous ranges,
+// which map onto whole pages. Cyclades spreads each thread's vertices over
+// the whole graph, so there each page goes to its middle vertex's thread.
+// The pipelined schedule changes every sweep, so its pages are dealt to
+// the workers round robin.
+void PlaceSampler(Sampler &s) {
+    PinThreads();
+    int n = config.n;
+    vector<int> owner(n, 0);
+    if (config.cyclades_pipeline) {
+	size_t per_page = sysconf(_SC_PAGESIZE) / sizeof(int);
+	for (int v = 0; v < n; v++) owner[v] = v / per_page % config.n_threads;
+    }
+    for (int thread = 0; thread < s.access_pattern.size(); thread++) {
+	for (int batch = 0; batch < s.access_pattern[thread].size(); batch++) {
+	    for (int i = 0; i < s.access_pattern[thread][batch].size(); i++) {
+		owner[s.access_pattern[thread][batch][i]] = thread;
+	    }
+	}
+    }
+    Array<int> &offsets = s.g.offsets;
+    auto vertex_owner = [&](size_t v) { return owner[min(v, (size_t)n-1)]; };
+    auto entry_owner = [&](size_t k) {
+	return owner[upper_bound(offsets.begin(), offsets.end(), (int)k) - offsets.begin() - 1];
+    };
+
+    if (config.packed_state) {
+	FirstTouch(s.packed.words.data(), s.packed.words.size(), [&](size_t w) { return vertex_owner(w * 64); });
+    }
+    else {
+	// Ghosts of the padded layout belong to the thread that reads them.
+	vector<int> slot_owner(s.state.size(), owner[n-1]);
+	copy(owner.begin(), owner.end(), slot_owner.begin());
+	for (int thread = 0; thread < s.ghosts.size(); thread++) {
+	    for (int i = 0; i < s.ghosts[thread].size(); i++) slot_owner[s.ghosts[thread][i].first] = thread;
+	}
+	FirstTouch(s.state.data(), s.state.size(), [&](size_t i) { return slot_owner[i]; });
+    }
+    if (config.layout == PADDED_LAYOUT) {
+	FirstTouch(s.layout_graph.neighbors.begin(), s.layout_graph.neighbors.size(), entry_owner);
+	FirstTouch(s.layout_weighted.edges.begin(), s.layout_weighted.edges.size(), entry_owner);
+    }
+    // Graphs mapped from a file are left to the page cache.
+    if (s.g.neighbors.Owned()) {
+	FirstTouch(s.g.neighbors.begin(), s.g.neighbors.size(), entry_owner);
+    }
+    if (s.weighted.edges.Owned()) {
+	FirstTouch(s.weighted.edges.begin(), s.weighted.edges.size(), entry_owner);
+	FirstTouch(s.weighted.field.begin(), s.weighted.field.size(), vertex_owner);
+	FirstTouch(s.weighted.offsets.begin(), s.weighted.offsets.size(), vertex_owner);
+    }
+    if (offsets.Owned()) FirstTouch(offsets.begin(), offsets.size(), vertex_owner);
+}
+
+// Move a sampler to another temperature. Only the lookup tables depend on
+// beta, so this is cheap enough for every tempering swap.
+void SetSamplerBeta(Sampler &s, double beta) {
+    int max_degree = s.table.threshold.empty() ? MaxDegree(s.g) : s.table.max_degree;
+    s.beta = beta;
+    if (config.potts_q > 0) {
+	BuildPottsModel(s.potts, config.potts_q, config.potts_interaction, beta, max_degree);
+    }
+    BuildConditionalTable(s.table, beta, max_degree);
+}
+
+// Clusters per Wolff sweep such that a sweep flips about n spins once the
+// chain has equilibrated: the mean count over the last 10 of 20 sweeps
+// that each run until n spins flipped, on a copy of the state. This only
+// depends on the initial state, beta and the seed.
+int CalibrateWolff(Sampler &s) {
+    vector<int> state(s.state.begin(), s.state.begin() + config.n);
+    Observables unused;
+    long long total = 0;
+    for (int sweep = 0; sweep < 20; sweep++) {
+	int count = WolffSweep(s.g, state, s.in_cluster, s.cluster_stack, s.table.bond_threshold, 0, sweep, 13, unused);
+	if (sweep >= 10) total += count;
+    }
+    return max(1LL, (total + 5) / 10);
+}
+
+void InitSampler(Sampler &s, const vector<int> &state, double beta) {
+    SetSamplerBeta(s, beta);
+    SetSamplerState(s, state);
+    PartitionSampler(s);
+    s.lattice_kernel = SelectLatticeRowKernel(config.simd, &s.lattice_kernel_name);
+    s.wolff_clusters = 0;
+    if (config.mode == WOLFF) {
+	s.wolff_clusters = config.wolff_clusters > 0 ? config.wolff_clusters : CalibrateWolff(s);
+    }
+    if (config.numa) PlaceSampler(s);
+}
+
+// Sweep of the padded layout, see BuildPaddedLayout: after each batch
+// and its barrier, every thread copies the batch's new spins into its
+// ghosts.
+template <typename UpdateFunction>
+Observables PaddedSweep(Sampler &s, int sweep, UpdateFunction update) {
+    Observables total;
+#pragma omp parallel num_threads(config.n_threads)
+    {
+	int thread = omp_get_thread_num();
+	vector<pair<int, int> > &ghosts = s.batch_ghosts[thread];
+	vector<int> &offsets = s.ghost_offsets[thread];
+	vector<int> &state = s.state;
+	Observables delta;
+	for (int batch = 0; batch < s.n_batches; batch++) {
+	    vector<int> &to_update = s.access_pattern[thread][batch];
+	    for (int i = 0; i < to_update.size(); i++) update(to_update[i], sweep, delta);
+#pragma omp barrier
+	    for (int i = offsets[batch]; i < offsets[batch+1]; i++) {
+		state[ghosts[i].first] = state[ghosts[i].second];
+	    }
+	}
+#pragma omp critical
+	{
+	    total.magnetization += delta.magnetization;
+	    total.energy += delta.energy;
+	}
+    }
+    return total;
+}
+
+// One pass of update over s's schedule.
+template <typename UpdateFunction>
+Observables ScheduledSweep(Sampler &s, int sweep, UpdateFunction update) {
+    if (config.cyclades_pipeline) return PipelinedSweep(s.g, s.pipeline, sweep, update);
+    if (config.layout == PADDED_LAYOUT) return PaddedSweep(s, sweep, update);
+    return Sweep(s.access_pattern, s.n_batches, sweep, update);
+}
+
+void RunSweep(Sampler &s, int iter) {
+    bool padded = config.layout == PADDED_LAYOUT;
+    Graph &g = padded ? s.layout_graph : s.g;
+    ConditionalTable &table = s.table;
+    Observables delta;
+    if (UsesLatticeKernel()) {
+	delta = LatticeSweep(s.state, table, s.lattice_kernel, config.mode == CHECKERBOARD, iter);
+    }
+    else if (config.mode == SWENDSEN_WANG) {
+	Observables updated = SwendsenWangSweep(g, s.state, s.cluster_parent, s.cluster_flips, table.bond_threshold, iter);
+	delta.magnetization = updated.magnetization - s.observables.magnetization;
+	delta.energy = updated.energy - s.observables.energy;
+    }
+    else if (config.mode == WOLFF) {
+	WolffSweep(g, s.state, s.in_cluster, s.cluster_stack, table.bond_threshold, s.wolff_clusters, iter, 12, delta);
+    }
+    else if (config.multispin) {
+	// Observables are per replica, see PrintReplicaStatistics.
+	vector<uint64_t> &replicas = s.replicas;
+	ScheduledSweep(s, iter, [&](int index, int sweep, Observables &d) {
+	    UpdateMultiSpin(g, replicas, table, index, sweep);
+	});
+	return;
+    }
+    else if (config.potts_q > 0) {
+	vector<int> &state = s.state;
+	PottsModel &potts = s.potts;
+	delta = ScheduledSweep(s, iter, [&](int index, int sweep, Observables &d) {
+	    UpdatePottsState(g, state, potts, index, sweep, d);
+	});
+    }
+    else if (config.weighted) {
+	vector<int> &state = s.state;
+	WeightedGraph &weighted = padded ? s.layout_weighted : s.weighted;
+	float beta = s.beta;
+	delta = ScheduledSweep(s, iter, [&](int index, int sweep, Observables &d) {
+	    UpdateWeightedState(weighted, state, beta, index, sweep, d);
+	});
+    }
+    else if (!config.packed_state) {
+	vector<int> &state = s.state;
+	delta = ScheduledSweep(s, iter, [&](int index, int sweep, Observables &d) {
+	    UpdateState(g, state, table, index, sweep, d);
+	});
+    }
+    else if (config.mode == HOGWILD) {
+	PackedState &packed = s.packed;
+	delta = ScheduledSweep(s, iter, [&](int index, int sweep, Observables &d) {
+	    UpdatePackedState<false>(g, packed, table, index, sweep, d);
+	});
+    }
+    else {
+	PackedState &packed = s.packed;
+	delta = ScheduledSweep(s, iter, [&](int index, int sweep, Observables &d) {
+	    UpdatePackedState<true>(g, packed, table, index, sweep, d);
+	});
+    }
+    s.observables.magnetization += delta.magnetization;
+    s.observables.energy += delta.energy;
+}
+
+// Nearest-rank percentile of sorted values.
+double Percentile(const vector<double> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    int rank = (int)ceil(p / 100.0 * sorted.size());
+    return sorted[min((int)sorted.size(), max(1, rank)) - 1];
+}
+
+// Magnetization and energy per spin of each of the 64 replicas, summarized
+// by their mean and standard deviation across replicas.
+void PrintReplicaStatistics(Sampler &s, int sweep) {
+    Graph &g = s.g;
+    ReplicaCounter up, disagree;
+    for (int v = 0; v < config.n; v++) {
+	up.Add(s.replicas[v]);
+	for (int j = g.offsets[v]; j < g.offsets[v+1]; j++) {
+	    if (g.neighbors[j] > v) disagree.Add(s.replicas[v] ^ s.replicas[g.neighbors[j]]);
+	}
+    }
+    long long n_edges = g.neighbors.size() / 2;
+    double m_sum = 0, m_squares = 0, abs_m_sum = 0, e_sum = 0, e_squares = 0;
+    for (int r = 0; r < 64; r++) {
+	double m = (2.0 * up.Count(r) - config.n) / config.n;
+	double e = -(n_edges - 2.0 * disagree.Count(r)) / config.n;
+	m_sum += m;
+	m_squares += m * m;
+	abs_m_sum += fabs(m);
+	e_sum += e;
+	e_squares += e * e;
+    }
+    double m_mean = m_sum / 64, e_mean = e_sum / 64;
+    printf("Sweep %d: 64 replicas, m %.6f (sd %.6f) |m| %.6f e %.6f (sd %.6f)\n", sweep, m_mean,
+	   sqrt(max(0.0, m_squares / 64 - m_mean * m_mean)), abs_m_sum / 64, e_mean,
+	   sqrt(max(0.0, e_squares / 64 - e_mean * e_mean)));
+}
+
+// Checkpoint file, written whole to a temporary file and renamed over the
+// old one, so a crash leaves either the previous or the new checkpoint:
+//   "CYCCHKPT", uint32 version
+//   fingerprint of the options that define the chain, as a string
+//   next sweep, observables, both autocorrelation estimators
+//   the state as int32 values
+//   uint64 FNV-1a hash of everything before it
+// Random numbers are a pure function of (seed, vertex, sweep), and the
+// graph and access pattern are rebuilt from the same options and seed, so
+// the state and sweep number are enough to continue the chain exactly.
+#define CHECKPOINT_MAGIC "CYCCHKPT"
+#define CHECKPOINT_VERSION 1
+
+struct Diagnostics {
+    Diagnostics() : magnetization(1000), energy(1000) {}
+    AutocorrelationEstimator magnetization;
+    AutocorrelationEstimator energy;
+};
+
+// Options a resumed run must share with the checkpointed one. The thread
+// count may change; only the schedules that are deterministic across
+// thread counts (Cyclades, checkerboard) then continue bit-identically.
+// --numa and --simd move data or pick kernels without changing the chain,
+// and --betas and --multispin do not support checkpoints.
+string CheckpointFingerprint() {
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer),
+	     "n=%d delta=%d beta=%.17g mode=%d graph=%d graph-file=%s seed=%llu potts=%d interaction=%d "
+	     "weighted=%d coupling-sigma=%.17g field=%.17g field-sigma=%.17g packed=%d layout=%d reorder=%d "
+	     "batch-size=%d pipeline=%d wolff-clusters=%d burn-in=%d",
+	     config.n, config.delta, config.beta, config.mode, config.graph, config.graph_file.c_str(),
+	     (unsigned long long)config.seed, config.potts_q, config.potts_interaction, config.weighted,
+	     config.coupling_sigma, config.field_mean, config.field_sigma, config.packed_state,
+	     config.layout, config.reorder, config.cyclades_batch_size, config.cyclades_pipeline,
+	     config.wolff_clusters, config.burn_in);
+    return buffer;
+}
+
+void WriteCheckpoint(Sampler &s, int next_iteration, const Diagnostics &diagnostics) {
+    vector<char> out;
+    out.insert(out.end(), CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + 8);
+    Put(out, (uint32_t)CHECKPOINT_VERSION);
+    string fingerprint = CheckpointFingerprint();
+    PutArray(out, vector<char>(fingerprint.begin(), fingerprint.end()));
+    Put(out, (int64_t)next_iteration);
+    Put(out, (int64_t)s.observables.magnetization);
+    Put(out, s.observables.energy);
+    diagnostics.magnetization.Save(out);
+    diagnostics.energy.Save(out);
+    vector<int> state = FromSamplerOrder(s, GetSamplerState(s));
+    PutArray(out, vector<int32_t>(state.begin(), state.end()));
+    Put(out, Fnv1a(out.data(), out.size()));
+
+    string temporary = config.checkpoint_file + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    bool ok = file && fwrite(out.data(), 1, out.size(), file) == out.size();
+    ok = file && fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+    ok = file && fclose(file) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), config.checkpoint_file.c_str()) != 0) {
+	cout << "Error: Could not write checkpoint " << config.checkpoint_file << endl;
+	exit(1);
+    }
+    // Make the rename itself durable.
+    size_t slash = config.checkpoint_file.rfind('/');
+    string directory = slash == string::npos ? "." : config.checkpoint_file.substr(0, slash + 1);
+    int fd = open(directory.c_str(), O_RDONLY);
+    if (fd >= 0) {
+	fsync(fd);
+	close(fd);
+    }
+}
+
+// Restore the chain from config.checkpoint_file and return the next sweep
+// to run, or return 0 and leave everything alone if there is no file.
+int ReadCheckpoint(Sampler &s, Diagnostics &diagnostics) {
+    ifstream file(config.checkpoint_file.c_str(), ios::in | ios::binary);
+    if (!file) return 0;
+    vector<char> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    const char *in = data.data(), *end = data.data() + data.size();
+
+    uint64_t hash;
+    bool ok = data.size() >= 8 + sizeof(hash) && memcmp(in, CHECKPOINT_MAGIC, 8) == 0;
+    if (ok) {
+	memcpy(&hash, end - sizeof(hash), sizeof(hash));
+	end -= sizeof(hash);
+	ok = hash == Fnv1a(data.data(), end - data.data());
+	in += 8;
+    }
+    uint32_t version;
+    vector<char> fingerprint;
+    if (!ok || !Get(in, end, version) || version != CHECKPOINT_VERSION || !GetArray(in, end, fingerprint)) {
+	cout << "Error: " << config.checkpoint_file << " is not a valid version " << CHECKPOINT_VERSION << " checkpoint." << endl;
+	exit(1);
+    }
+    if (string(fingerprint.begin(), fingerprint.end()) != CheckpointFingerprint()) {
+	cout << "Error: " << config.checkpoint_file << " was written with different options:" << endl;
+	cout << "  " << string(fingerprint.begin(), fingerprint.end()) << endl;
+	exit(1);
+    }
+    int64_t next_iteration, magnetization;
+    double energy;
+    vector<int32_t> state;
+    if (!Get(in, end, next_iteration) || !Get(in, end, magnetization) || !Get(in, end, energy) ||
+	!diagnostics.magnetization.Load(in, end) || !diagnostics.energy.Load(in, end) ||
+	!GetArray(in, end, state) || state.size() != config.n || in != end) {
+	cout << "Error: " << config.checkpoint_file << " is corrupt." << endl;
+	exit(1);
+    }
+    SetSamplerState(s, ToSamplerOrder(s, vector<int>(state.begin(), state.end())));
+    // Keep the running totals rather than the recomputed ones, whose
+    // rounding can differ.
+    s.observables.magnetization = magnetization;
+    s.observables.energy = energy;
+    return next_iteration;
+}
+
+// Point copy's arrays at the ones of original without copying them.
+template <typename T>
+void ShareArray(Array<T> &copy, const Array<T> &original) {
+    copy.View(original.begin(), original.size());
+}
+
+// Replica exchange over config.betas, in increasing order. Replica r is
+// swept with sweep number iter*K + r, which gives every replica its own
+// random numbers. Every swap_interval sweeps, neighboring temperatures
+// k, k+1 (alternately even and odd k) swap their replicas with probability
+// min(1, exp((beta_k - beta_k+1) * (E_k - E_k+1))), using the running
+// energies. Swapping moves the betas rather than the states, which only
+// rebuilds two small tables. Wolff cluster counts depend on beta, so they
+// are calibrated once per temperature and move with the betas.
+//
+// All replicas cost the same per sweep, so the threads are split into
+// equal groups: with K >= threads, one thread per group and replicas dealt
+// round robin; otherwise threads/K threads per replica in nested teams.
+// Snapshots and diagnostics follow whichever replica is at the largest beta.
+void RunTempering(Sampler &base, const vector<int> &initial_state) {
+    int n_replicas = config.betas.size(), n_threads = config.n_threads;
+    int n_groups = min(n_threads, n_replicas);
+    config.n_threads = max(1, n_threads / n_replicas);
+    if (config.n_threads > 1) omp_set_max_active_levels(2);
+    if (n_groups * config.n_threads < n_threads) {
+	cerr << "Warning: Using " << n_groups * config.n_threads << " of " << n_threads
+	     << " threads, a multiple of the replica count balances better." << endl;
+    }
+    printf("Tempering: %d replicas on %d groups of %d threads\n", n_replicas, n_groups, config.n_threads);
+
+    vector<Sampler> replicas(n_replicas);
+    vector<int> replica_at(n_replicas);     // Replica at each temperature
+    vector<int> wolff_clusters(n_replicas); // Wolff clusters at each temperature
+    for (int r = 0; r < n_replicas; r++) {
+	Sampler &replica = replicas[r];
+	ShareArray(replica.g.offsets, base.g.offsets);
+	ShareArray(replica.g.neighbors, base.g.neighbors);
+	if (config.weighted) {
+	    ShareArray(replica.weighted.offsets, base.weighted.offsets);
+	    ShareArray(replica.weighted.edges, base.weighted.edges);
+	    ShareArray(replica.weighted.field, base.weighted.field);
+	}
+	replica.relabel = base.relabel;
+	InitSampler(replica, initial_state, config.betas[r]);
+	replica_at[r] = r;
+	wolff_clusters[r] = replica.wolff_clusters;
+    }
+
+    SnapshotWriter *snapshots = NULL;
+    if (config.snapshot_interval > 0) {
+	snapshots = new SnapshotWriter(config.snapshot_file, config.graph == LATTICE_2D, config.snapshot_binary);
+    }
+    AutocorrelationEstimator magnetization(1000), energy(1000);
+    vector<long> attempts(n_replicas-1, 0), accepts(n_replicas-1, 0);
+    vector<double> busy(n_groups, 0);
+    double sweeping = 0;
+
+    for (int iter = 0; iter < config.n_iterations; iter++) {
+	Sampler &coldest = replicas[replica_at[n_replicas-1]];
+	if (snapshots && iter % config.snapshot_interval == 0) {
+	    snapshots->Submit(iter, FromSamplerOrder(coldest, GetSamplerState(coldest)));
+	}
+	double start = omp_get_wtime();
+#pragma omp parallel num_threads(n_groups)
+	{
+	    int group = omp_get_thread_num();
+	    double group_start = omp_get_wtime();
+	    for (int r = group; r < n_replicas; r += n_groups) {
+		RunSweep(replicas[r], iter * n_replicas + r);
+		// Shared-layout Hogwild observables drift, see main.
+		if (config.mode == HOGWILD && config.layout == SHARED_LAYOUT && config.n_threads > 1 && iter % 64 == 63) {
+		    replicas[r].observables = ComputeObservables(replicas[r]);
+		}
+	    }
+	    busy[group] += omp_get_wtime() - group_start;
+	}
+	sweeping += omp_get_wtime() - start;
+
+	if ((iter+1) % config.swap_interval == 0) {
+	    int round = (iter+1) / config.swap_interval;
+	    for (int k = round % 2; k + 1 < n_replicas; k += 2) {
+		Sampler &hot = replicas[replica_at[k]], &cold = replicas[replica_at[k+1]];
+		double log_ratio = (config.betas[k] - config.betas[k+1]) * (hot.observables.energy - cold.observables.energy);
+		attempts[k]++;
+		if (log_ratio >= 0 || RandomUniform(config.seed, k, round, 9) < exp(log_ratio)) {
+		    accepts[k]++;
+		    swap(replica_at[k], replica_at[k+1]);
+		    SetSamplerBeta(replicas[replica_at[k]], config.betas[k]);
+		    SetSamplerBeta(replicas[replica_at[k+1]], config.betas[k+1]);
+		    replicas[replica_at[k]].wolff_clusters = wolff_clusters[k];
+		    replicas[replica_at[k+1]].wolff_clusters = wolff_clusters[k+1];
+		}
+	    }
+	}
+
+	if (iter < config.burn_in) continue;
+	Sampler &target = replicas[replica_at[n_replicas-1]];
+	magnetization.Add((double)target.observables.magnetization / config.n);
+	energy.Add((double)target.observables.energy / config.n);
+	if (config.diagnostics_interval > 0 && (iter+1) % config.diagnostics_interval == 0) {
+	    printf("Sweep %d: beta %g m %.6f (tau %.1f, ess %.1f, se %.2e) e %.6f (tau %.1f, ess %.1f, se %.2e)\n",
+		   iter+1, config.betas[n_replicas-1], magnetization.Mean(), magnetization.Tau(),
+		   magnetization.EffectiveSampleSize(), magnetization.StandardError(), energy.Mean(), energy.Tau(),
+		   energy.EffectiveSampleSize(), energy.StandardError());
+	}
+    }
+
+    printf("Swap acceptance:");
+    for (int k = 0; k + 1 < n_replicas; k++) {
+	printf(" %g-%g %.3f", config.betas[k], config.betas[k+1], attempts[k] > 0 ? (double)accepts[k] / attempts[k] : 0.0);
+    }
+    printf("\n");
+    double total_busy = 0;
+    for (int group = 0; group < n_groups; group++) total_busy += busy[group];
+    if (sweeping > 0) {
+	printf("Barrier wait: %.1f%% of group time\n", 100 * max(0.0, 1 - total_busy / (n_groups * sweeping)));
+    }
+    if (snapshots) {
+	Sampler &coldest = replicas[replica_at[n_replicas-1]];
+	snapshots->Submit(config.n_iterations, FromSamplerOrder(coldest, GetSamplerState(coldest)), true);
+	delete snapshots;
+    }
+    config.n_threads = n_threads;
+}
+
+// For each thread count in config.benchmark_threads, restart from
+// initial_state, run one untimed warmup sweep and then time
+// config.n_iterations sweeps. Reports spin updates per second, sweep
+// latency percentiles and the speedup over the first thread count, one
+// CSV row or JSON object per line.
+void RunBenchmark(Sampler &s, const vector<int> &initial_state) {
+    const char *mode_names[] = {"hogwild", "cyclades", "checkerboard", "swendsen-wang", "wolff"};
+    const char *mode = mode_names[config.mode];
+    const char *graph = config.graph == LATTICE_2D ? "2d" : config.graph == RANDOM_GRAPH ? "random" : "file";
+    const char *state = config.packed_state ? "packed" : "int";
+    const char *layout = config.layout == PADDED_LAYOUT ? "padded" : "shared";
+    const char *kernel = UsesLatticeKernel() ? s.lattice_kernel_name : config.multispin ? "multispin" : "graph";
+    // Each multi-spin update advances 64 replicas.
+    int updates_per_vertex = config.multispin ? 64 : 1;
+
+    FILE *out = stdout;
+    bool write_header = true;
+    if (!config.benchmark_output.empty()) {
+	out = fopen(config.benchmark_output.c_str(), "a");
+	if (!out) {
+	    cout << "Error: Could not open benchmark output " << config.benchmark_output << endl;
+	    exit(1);
+	}
+	// Appending to an existing file, so only a new file gets a header.
+	fseek(out, 0, SEEK_END);
+	write_header = ftell(out) == 0;
+    }
+    if (config.benchmark_json) write_header = false;
+    if (write_header) {
+	fprintf(out, "mode,graph,n,state,layout,kernel,threads,sweeps,updates_per_sec,"
+		"p50_sweep_ms,p90_sweep_ms,p99_sweep_ms,speedup,partition_ms\n");
+    }
+
+    double baseline = 0;
+    for (int run = 0; run < config.benchmark_threads.size(); run++) {
+	config.n_threads = config.benchmark_threads[run];
+	omp_set_num_threads(config.n_threads);
+	double partition_start = omp_get_wtime();
+	PartitionSampler(s);
+	double partition_ms = (omp_get_wtime() - partition_start) * 1000;
+	SetSamplerState(s, initial_state);
+	if (config.numa) PlaceSampler(s);
+
+	RunSweep(s, 0);
+	vector<double> latencies(config.n_iterations);
+	double total = 0;
+	for (int iter = 0; iter < config.n_iterations; iter++) {
+	    double start = omp_get_wtime();
+	    RunSweep(s, iter+1);
+	    latencies[iter] = omp_get_wtime() - start;
+	    total += latencies[iter];
+	}
+	sort(latencies.begin(), latencies.end());
+
+	double updates_per_sec = total > 0 ? (double)config.n * updates_per_vertex * config.n_iterations / total : 0;
+	if (run == 0) baseline = updates_per_sec;
+	double speedup = baseline > 0 ? updates_per_sec / baseline : 0;
+	double p50 = Percentile(latencies, 50) * 1000;
+	double p90 = Percentile(latencies, 90) * 1000;
+	double p99 = Percentile(latencies, 99) * 1000;
+	if (config.benchmark_json) {
+	    fprintf(out, "{\"mode\": \"%s\", \"graph\": \"%s\", \"n\": %d, \"state\": \"%s\", "
+		    "\"layout\": \"%s\", \"kernel\": \"%s\", \"threads\": %d, \"sweeps\": %d, \"updates_per_sec\": %.6g, "
+		    "\"p50_sweep_ms\": %.6g, \"p90_sweep_ms\": %.6g, \"p99_sweep_ms\": %.6g, \"speedup\": %.4f, \"partition_ms\": %.6g}\n",
+		    mode, graph, config.n, state, layout, kernel, config.n_threads, config.n_iterations,
+		    updates_per_sec, p50, p90, p99, speedup, partition_ms);
+	}
+	else {
+	    fprintf(out, "%s,%s,%d,%s,%s,%s,%d,%d,%.6g,%.6g,%.6g,%.6g,%.4f,%.6g\n",
+		    mode, graph, config.n, state, layout, kernel, config.n_threads, config.n_iterations,
+		    updates_per_sec, p50, p90, p99, speedup, partition_ms);
+	}
+	fflush(out);
+    }
+    if (out != stdout) fclose(out);
+}
+
+int main(int argc, char *argv[]) {
+    config = ParseArguments(argc, argv);
+    omp_set_num_threads(config.n_threads);
+    srand((unsigned int)(config.seed ^ (config.seed >> 32)));
+
+    if (!config.read_snapshots.empty()) {
+	ReadSnapshots(config.read_snapshots, config.read_iteration);
+	return 0;
+    }
+    if (!config.convert_edge_list.empty()) {
+	ConvertEdgeList(config.convert_edge_list, config.graph_file);
+	return 0;
+    }
+
+    // Generate graph. A mapped graph file must outlive the sampler.
+    MappedFile graph_file;
+    Sampler sampler;
+    if (config.graph == LATTICE_2D) {
+	sampler.g = Generate2DIsingModelGraph();
+    }
+    else if (config.graph == RANDOM_GRAPH) {
+	sampler.g = GenerateRandomIsingModelGraph();
+    }
+    else {
+	LoadGraphFile(config.graph_file, graph_file, sampler.g, sampler.weighted);
+	config.n = sampler.g.offsets.size() - 1;
+	config.delta = MaxDegree(sampler.g);
+    }
+    PrintGraphStatistics(sampler.g);
+
+    // A weighted graph file already supplies couplings and fields. Drawn
+    // ones are keyed by the generated labels, so draw them before
+    // reordering, which permutes them with the graph.
+    if (config.weighted && sampler.weighted.offsets.size() == 0) sampler.weighted = BuildWeightedGraph(sampler.g);
+    if (config.reorder != NO_REORDER) ReorderSampler(sampler);
+
+    // Generate variables.
+    vector<int> state = config.potts_q > 0 ? GeneratePottsState() : GenerateIsingState();
+    state = ToSamplerOrder(sampler, state);
+    InitSampler(sampler, state, config.beta);
+
+    if (!config.benchmark_threads.empty()) {
+	RunBenchmark(sampler, state);
+	return 0;
+    }
+    if (!config.betas.empty()) {
+	RunTempering(sampler, state);
+	return 0;
+    }
+    if (UsesLatticeKernel()) {
+	printf("Lattice kernel: %s\n", sampler.lattice_kernel_name);
+    }
+    if (config.mode == WOLFF) {
+	printf("Wolff clusters per sweep: %d\n", sampler.wolff_clusters);
+    }
+    if (config.mode == CYCLADES && !config.cyclades_pipeline) {
+	CycladesTiming &timing = sampler.cyclades_timing;
+	printf("Cyclades partition: %d batches, %.3f ms components + %.3f ms assignment per batch\n",
+	       timing.n_batches, 1000 * timing.components / timing.n_batches, 1000 * timing.assignment / timing.n_batches);
+    }
+
+    bool diagnostics = config.diagnostics_interval > 0 || config.target_ess > 0 || config.tolerance > 0;
+    Diagnostics series;
+    AutocorrelationEstimator &magnetization = series.magnetization, &energy = series.energy;
+
+    int iter = 0;
+    if (config.resume) {
+	iter = ReadCheckpoint(sampler, series);
+	if (iter > 0) printf("Resuming at sweep %d.\n", iter);
+	else printf("No checkpoint at %s, starting from sweep 0.\n", config.checkpoint_file.c_str());
+    }
+
+    SnapshotWriter *snapshots = NULL;
+    if (config.snapshot_interval > 0) {
+	snapshots = new SnapshotWriter(config.snapshot_file, config.graph == LATTICE_2D, config.snapshot_binary, iter);
+    }
+    bool checkpoints = !config.checkpoint_file.empty();
+    for (; iter < config.n_iterations; iter++) {
+	if (checkpoints && config.checkpoint_interval > 0 && iter > 0 && iter % config.checkpoint_interval == 0) {
+	    // The snapshot file must hold every sweep before the checkpoint.
+	    if (snapshots) snapshots->Flush();
+	    WriteCheckpoint(sampler, iter, series);
+	}
+	if (snapshots && iter % config.snapshot_interval == 0) {
+	    snapshots->Submit(iter, FromSamplerOrder(sampler, GetSamplerState(sampler)));
+	}
+	RunSweep(sampler, iter);
+	if (config.multispin) {
+	    bool report = config.diagnostics_interval > 0 && (iter+1) % config.diagnostics_interval == 0;
+	    if (report || iter+1 == config.n_iterations) PrintReplicaStatistics(sampler, iter+1);
+	    continue;
+	}
+	if (!diagnostics) continue;
+
+	// Shared-layout Hogwild updates race, so resynchronize the running
+	// observables now and then instead of letting errors accumulate.
+	if (config.mode == HOGWILD && config.layout == SHARED_LAYOUT && config.n_threads > 1 && iter % 64 == 63) {
+	    sampler.observables = ComputeObservables(sampler);
+	}
+	if (iter < config.burn_in) continue;
+	magnetization.Add((double)sampler.observables.magnetization / config.n);
+	energy.Add((double)sampler.observables.energy / config.n);
+
+	bool report = config.diagnostics_interval > 0 && (iter+1) % config.diagnostics_interval == 0;
+	// Autocorrelation estimates need a run of ~50 tau to be trusted.
+	double tau = max(magnetization.Tau(), energy.Tau());
+	bool converged = (config.target_ess > 0 || config.tolerance > 0) && magnetization.Count() >= 50 * tau;
+	if (config.target_ess > 0) {
+	    converged = converged && min(magnetization.EffectiveSampleSize(), energy.EffectiveSampleSize()) >= config.target_ess;
+	}
+	if (config.tolerance > 0) {
+	    converged = converged && max(magnetization.StandardError(), energy.StandardError()) <= config.tolerance;
+	}
+	if (report || converged) {
+	    printf("Sweep %d: m %.6f (tau %.1f, ess %.1f, se %.2e) e %.6f (tau %.1f, ess %.1f, se %.2e)\n",
+		   iter+1, magnetization.Mean(), magnetization.Tau(), magnetization.EffectiveSampleSize(),
+		   magnetization.StandardError(), energy.Mean(), energy.Tau(), energy.EffectiveSampleSize(),
+		   energy.StandardError());
+	}
+	if (converged) {
+	    printf("Converged after %d sweeps.\n", iter+1);
+	    iter++;
+	    break;
+	}
+    }
+
+    if (config.cyclades_pipeline) {
+	CycladesPipeline &pipeline = sampler.pipeline;
+	printf("Cyclades pipeline: %.3f ms planning per batch, workers busy %.1f%% of sweep time\n",
+	       pipeline.n_planned > 0 ? 1000 * pipeline.planning / pipeline.n_planned : 0.0,
+	       pipeline.elapsed > 0 ? 100 * pipeline.working / (config.n_threads * pipeline.elapsed) : 0.0);
+    }
+    if (checkpoints) {
+	if (snapshots) snapshots->Flush();
+	WriteCheckpoint(sampler, iter, series);
+    }
+    if (snapshots) {
+	snapshots->Submit(iter, FromSamplerOrder(sampler, GetSamplerState(sampler)), true);
+	delete snapshots;
+    }
 }